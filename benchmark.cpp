@@ -0,0 +1,618 @@
+#include "compiler.h"
+#include "pool.h"
+#include "scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+// Times the noise builtins of the batch interpreter against the scalar
+// reference and checks that both agree, times the compiler on a large
+// generated script and reports how much memory a compiled program and the
+// attributes of its particles take and how an update scales over threads.
+// On Linux the hardware counters of every workload are read as well.
+
+static double seconds(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(const char* name, unsigned int count, double scalar, double batch, float error)
+{
+	printf("%-8s scalar %8.2f ns  batch %8.2f ns  speedup %5.2fx  max error %g\r\n", name,
+		scalar * 1e9 / count, batch * 1e9 / count, batch > 0.0 ? scalar / batch : 0.0, error);
+}
+
+// Hardware counters of the calling thread and the threads it starts while
+// they count, read with perf_event_open. Counters the kernel or the machine
+// does not offer stay closed and read as -1, on other systems all of them.
+enum hw_counter
+{
+	hw_cycles,
+	hw_instructions,
+	hw_branch_misses,
+	hw_l1d_misses,
+	hw_llc_misses,
+	hw_count
+};
+
+struct hw_counters
+{
+	int fds[hw_count];
+
+	hw_counters()
+	{
+		#ifdef __linux__
+		static const unsigned int types[hw_count] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, 
+			PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+		static const unsigned long long configs[hw_count] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, 
+			PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16), PERF_COUNT_HW_CACHE_MISSES };
+		for( int i = 0; i < hw_count; ++i ) {
+			perf_event_attr attr;
+			memset( &attr, 0, sizeof(attr) );
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			//Counters that share the hardware get scaled by how long they ran.
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			fds[i] = (int)syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+		}
+		#else
+		for( int i = 0; i < hw_count; ++i ) {
+			fds[i] = -1;
+		}
+		#endif
+	}
+
+	~hw_counters()
+	{
+		#ifdef __linux__
+		for( int i = 0; i < hw_count; ++i ) {
+			if( fds[i] >= 0 )
+			{
+				close(fds[i]);
+			}
+		}
+		#endif
+	}
+
+	bool available() const
+	{
+		return fds[hw_cycles] >= 0 && fds[hw_instructions] >= 0;
+	}
+
+	void start()
+	{
+		#ifdef __linux__
+		for( int i = 0; i < hw_count; ++i ) {
+			if( fds[i] >= 0 )
+			{
+				ioctl( fds[i], PERF_EVENT_IOC_RESET, 0 );
+				ioctl( fds[i], PERF_EVENT_IOC_ENABLE, 0 );
+			}
+		}
+		#endif
+	}
+
+	void stop(double* values)
+	{
+		for( int i = 0; i < hw_count; ++i ) {
+			values[i] = -1.0;
+			#ifdef __linux__
+			unsigned long long v[3];
+			if( fds[i] >= 0 && ioctl( fds[i], PERF_EVENT_IOC_DISABLE, 0 ) == 0 && read( fds[i], v, sizeof(v) ) == sizeof(v) && v[2] )
+			{
+				values[i] = (double)v[0] * v[1] / v[2];
+			}
+			#endif
+		}
+	}
+};
+
+// Prints the counters of a workload per particle, "n/a" for those that did
+// not count and nothing at all when none did.
+static void report_counters(const char* name, const char* kind, double count, const double* values)
+{
+	char text[hw_count + 1][16];
+	bool counted = false;
+	for( int i = 0; i < hw_count; ++i ) {
+		counted = counted || values[i] >= 0.0;
+		if( values[i] < 0.0 )
+		{
+			sprintf(text[i], "%8s", "n/a");
+		}
+		else
+		{
+			sprintf(text[i], i == hw_instructions ? "%8.1f" : "%8.3f", values[i] / count);
+		}
+	}
+
+	//IPC needs both counts, it is n/a when either failed to read.
+	if( values[hw_cycles] > 0.0 && values[hw_instructions] >= 0.0 )
+	{
+		sprintf(text[hw_count], "%5.2f", values[hw_instructions] / values[hw_cycles]);
+	}
+	else
+	{
+		sprintf(text[hw_count], "%5s", "n/a");
+	}
+
+	if( counted )
+	{
+		printf("%-8s %-9s IPC %s  %s instructions  branch misses %s  L1D misses %s  LLC misses %s per particle\r\n", 
+			name, kind, text[hw_count], text[hw_instructions], text[hw_branch_misses], text[hw_l1d_misses], 
+			text[hw_llc_misses]);
+	}
+}
+
+static void bench_noise(hw_counters& counters, int n, const std::vector<float>& points, unsigned int count)
+{
+	std::vector<float> reference(count), result(count);
+	double values[2][hw_count];
+	counters.start();
+	clock_t start = clock();
+	for( unsigned int i = 0; i < count; ++i ) {
+		float p[3] = { points[i], points[count + i], points[2 * count + i] };
+		reference[i] = noise(p, n, 1234);
+	}
+	double scalar = seconds(start);
+	counters.stop(values[0]);
+
+	counters.start();
+	start = clock();
+	for( unsigned int i = 0; i < count; i += PEL_LANES ) {
+		lanes p[3], out;
+		for( int k = 0; k < n; ++k ) {
+			memcpy( p[k].v, &points[k * count + i], sizeof(p[k].v) );
+		}
+		lanes_noise(p, n, 1234, out);
+		memcpy( &result[i], out.v, sizeof(out.v) );
+	}
+	double batch = seconds(start);
+	counters.stop(values[1]);
+
+	float error = 0.0f;
+	for( unsigned int i = 0; i < count; ++i ) {
+		float d = fabsf(result[i] - reference[i]);
+		error = d > error ? d : error;
+	}
+
+	char name[16];
+	sprintf(name, "noise%d", n);
+	report(name, count, scalar, batch, error);
+	report_counters(name, "scalar", count, values[0]);
+	report_counters(name, "batch", count, values[1]);
+}
+
+static void bench_curl(hw_counters& counters, const std::vector<float>& points, unsigned int count)
+{
+	std::vector<float> reference(count * 3), result(count * 3);
+	double values[2][hw_count];
+	counters.start();
+	clock_t start = clock();
+	for( unsigned int i = 0; i < count; ++i ) {
+		float p[3] = { points[i], points[count + i], points[2 * count + i] };
+		curl3(p, 1234, &reference[i * 3]);
+	}
+	double scalar = seconds(start);
+	counters.stop(values[0]);
+
+	counters.start();
+	start = clock();
+	for( unsigned int i = 0; i < count; i += PEL_LANES ) {
+		lanes p[3];
+		for( int k = 0; k < 3; ++k ) {
+			memcpy( p[k].v, &points[k * count + i], sizeof(p[k].v) );
+		}
+		lanes_curl3(p, 1234, p);
+		for( int l = 0; l < PEL_LANES; ++l ) {
+			for( int k = 0; k < 3; ++k ) {
+				result[(i + l) * 3 + k] = p[k].v[l];
+			}
+		}
+	}
+	double batch = seconds(start);
+	counters.stop(values[1]);
+
+	float error = 0.0f;
+	for( unsigned int i = 0; i < count * 3; ++i ) {
+		float d = fabsf(result[i] - reference[i]);
+		error = d > error ? d : error;
+	}
+	report("curl3", count, scalar, batch, error);
+	report_counters("curl3", "scalar", count, values[0]);
+	report_counters("curl3", "batch", count, values[1]);
+}
+
+// The same program through run for every particle and through run_batch.
+static void bench_program(hw_counters& counters, unsigned int count)
+{
+	std::vector<float> x(count), y(count), z(count);
+	for( unsigned int i = 0; i < count; ++i ) {
+		x[i] = (float)(i % 977) * 0.031f;
+		y[i] = (float)(i % 631) * 0.047f;
+		z[i] = (float)(i % 419) * 0.053f;
+	}
+
+	function f;
+	Local px = f.il_local("position.x"), py = f.il_local("position.y"), pz = f.il_local("position.z");
+	f.il_lfld(px);
+	f.il_lfld(py);
+	f.il_lfld(pz);
+	f.il_curl3();
+	f.il_vlfld(px, 3);
+	f.il_vadd(3);
+	f.il_vsfld(px, 3);
+	f.il_ret();
+	f.bind_column("position.x", &x[0]);
+	f.bind_column("position.y", &y[0]);
+	f.bind_column("position.z", &z[0]);
+
+	double values[2][hw_count];
+	counters.start();
+	clock_t start = clock();
+	for( unsigned int i = 0; i < count; ++i ) {
+		f.run(i);
+	}
+	double scalar = seconds(start);
+	counters.stop(values[0]);
+
+	counters.start();
+	start = clock();
+	f.run_batch(count);
+	double batch = seconds(start);
+	counters.stop(values[1]);
+	report("program", count, scalar, batch, 0.0f);
+	report_counters("program", "scalar", count, values[0]);
+	report_counters("program", "batch", count, values[1]);
+}
+
+// Generates a script of count statements over 64 fields that mixes
+// arithmetic, builtins and conditionals. The statements that scale a field
+// cycle through that many different literals.
+static std::string generate_script(unsigned int count, unsigned int literals)
+{
+	std::string source = "void main()\n{\n";
+	char line[256];
+	for( unsigned int i = 0; i < count; ++i ) {
+		unsigned int a = i % 64, b = (i * 7 + 3) % 64, c = (i * 13 + 5) % 64;
+		switch( i % 4 )
+		{
+			case 0: sprintf(line, "\tf%u = (f%u * %g) + f%u\n", a, b, 0.5 + (i / 4 % literals) * 0.25, c); break;
+			case 1: sprintf(line, "\tf%u = sin(f%u) + clamp(0.0, 1.0, f%u)\n", a, b, c); break;
+			case 2: sprintf(line, "\tif( f%u > f%u ) { f%u = f%u - 1.0 }\n", a, b, c, a); break;
+			case 3: sprintf(line, "\tf%u = lerp(f%u, f%u, 0.25) * (2.0 + 3.0)\n", a, b, c); break;
+		}
+		source += line;
+	}
+	source += "}\n";
+	return source;
+}
+
+// Counts what the scalar interpreter, the batch interpreter and the batch
+// interpreter on every core cost per particle on a generated script with
+// conditionals, to tell a dispatch that mispredicts from a batch that waits
+// on memory.
+static void bench_counters(hw_counters& counters, unsigned int count)
+{
+	std::string source = generate_script(64, 4);
+	function f;
+	compile(source.c_str(), source.size(), f);
+	std::vector< std::vector<float> > columns( f.locals.size() );
+	for( unsigned int i = 0; i < f.locals.size(); ++i ) {
+		columns[i].resize(count);
+		for( unsigned int n = 0; n < count; ++n ) {
+			columns[i][n] = (float)((n * 7 + i * 13) % 997) * 0.01f;
+		}
+		f.bind_column( f.localNames[i], &columns[i][0] );
+	}
+
+	double values[hw_count];
+	counters.start();
+	for( unsigned int i = 0; i < count; ++i ) {
+		f.run(i);
+	}
+	counters.stop(values);
+	report_counters("script", "scalar", count, values);
+
+	counters.start();
+	f.run_batch(count);
+	counters.stop(values);
+	report_counters("script", "batch", count, values);
+
+	counters.start();
+	run_parallel(f, count);
+	counters.stop(values);
+	report_counters("script", "parallel", count, values);
+}
+
+static void bench_compile(unsigned int count)
+{
+	std::string source = generate_script(count, 1);
+	function f;
+	clock_t start = clock();
+	int errors = compile(source.c_str(), source.size(), f);
+	double elapsed = seconds(start);
+	printf("compile  %u statements  %8.2f ms  %8.2f ns per statement  %d bytes of bytecode%s\r\n", count, 
+		elapsed * 1e3, elapsed * 1e9 / count, f.il_size(), errors ? "  (errors)" : "");
+}
+
+// Memory a program of count statements takes, with literals in the 
+// constant pool and with half precision literals in the bytecode.
+static void bench_footprint(unsigned int count)
+{
+	std::string source = generate_script(count, 64);
+	for( int half = 0; half < 2; ++half ) {
+		function f;
+		f.half_constants = half != 0;
+		compile(source.c_str(), source.size(), f);
+		unsigned int constants = f.constants.size() * sizeof(float);
+		unsigned int total = f.il_size() + constants + f.locals.size() * sizeof(float);
+		printf("%-8s %u statements  %7d bytes of bytecode  %5u bytes of constants  %6.2f bytes per statement\r\n", 
+			half ? "half" : "pool", count, f.il_size(), constants, (double)total / count);
+	}
+}
+
+// Ages count particles whose attributes are stored as floats and in the
+// reduced formats a script can declare them with.
+static void bench_formats(hw_counters& counters, unsigned int count)
+{
+	for( int reduced = 0; reduced < 2; ++reduced ) {
+		char source[512];
+		sprintf(source, 
+			"void main()\n{\n"
+			"\tvarying %sfloat age;\n"
+			"\tvarying %svec4 color;\n"
+			"\tvarying %sfloat rotation;\n"
+			"\tage = age + 0.016\n"
+			"\tcolor = vec4(color.x, color.y, color.z, color.w * 0.99)\n"
+			"\trotation = rotation + (age * 0.01)\n"
+			"}\n", 
+			reduced ? "half " : "", reduced ? "unorm8 " : "", reduced ? "snorm16 " : "");
+
+		function f;
+		compile(source, strlen(source), f);
+		std::vector< std::vector<char> > columns( f.locals.size() );
+		unsigned int size = 0;
+		for( unsigned int i = 0; i < f.locals.size(); ++i ) {
+			field_format format = f.format( f.localNames[i] );
+			columns[i].assign( count * format_size(format), 0 );
+			f.bind( f.localNames[i], &columns[i][0], format_size(format) );
+			size += format_size(format);
+		}
+
+		double values[hw_count];
+		counters.start();
+		clock_t start = clock();
+		f.run_batch(count);
+		double elapsed = seconds(start);
+		counters.stop(values);
+		printf("%-8s %2u bytes per particle  %8.2f ns per particle\r\n", reduced ? "reduced" : "float", 
+			size, elapsed * 1e9 / count);
+		report_counters(reduced ? "reduced" : "float", "batch", count, values);
+	}
+}
+
+// Times a double buffered update on one thread and on every core, the
+// wall clock is used because clock() adds up the time of all threads.
+static void bench_parallel(hw_counters& counters, unsigned int count)
+{
+	const char* source = 
+		"void main()\n{\n"
+		"\tvarying vec3 position, velocity;\n"
+		"\tvelocity = (velocity * 0.98) + (curl3(position * 0.5) * 0.1)\n"
+		"\tposition = position + (velocity * 0.016)\n"
+		"}\n";
+
+	function f;
+	compile(source, strlen(source), f);
+	std::vector< std::vector<float> > front( f.locals.size() ), back( f.locals.size() );
+	for( unsigned int i = 0; i < f.locals.size(); ++i ) {
+		front[i].resize(count);
+		back[i].resize(count);
+		for( unsigned int n = 0; n < count; ++n ) {
+			front[i][n] = (float)((n * 7 + i * 13) % 997) * 0.01f;
+		}
+		f.bind_double( f.localNames[i], &front[i][0], &back[i][0], sizeof(float) );
+	}
+
+	double values[2][hw_count];
+	counters.start();
+	double start = wall_seconds();
+	f.run_batch(count);
+	f.swap_buffers();
+	double single = wall_seconds() - start;
+	counters.stop(values[0]);
+
+	counters.start();
+	start = wall_seconds();
+	unsigned int threads = run_parallel(f, count);
+	f.swap_buffers();
+	double parallel = wall_seconds() - start;
+	counters.stop(values[1]);
+	printf("parallel 1 thread %8.2f ns  %2u threads %8.2f ns  speedup %5.2fx\r\n", single * 1e9 / count, 
+		threads, parallel * 1e9 / count, parallel > 0.0 ? single / parallel : 0.0);
+	report_counters("parallel", "batch", count, values[0]);
+	report_counters("parallel", "threads", count, values[1]);
+}
+
+// Runs a heavy update under a budget of 2 ms per frame and reports how many
+// frames a batch took, how often the budget cut a frame short and by how
+// much the slowest frame overran it.
+static void bench_budget(hw_counters& counters, unsigned int count)
+{
+	const char* source = 
+		"void main()\n{\n"
+		"\tvarying vec3 position, velocity;\n"
+		"\tvelocity = (velocity * 0.98) + (curl3(position * 0.5) * 0.1)\n"
+		"\tposition = position + (velocity * 0.016)\n"
+		"}\n";
+
+	function f;
+	compile(source, strlen(source), f);
+	std::vector< std::vector<float> > columns( f.locals.size() );
+	for( unsigned int i = 0; i < f.locals.size(); ++i ) {
+		columns[i].assign( count, (float)i );
+		f.bind( f.localNames[i], &columns[i][0], sizeof(float) );
+	}
+
+	const unsigned long long budget = 2000000;
+	batch_cursor cursor;
+	unsigned long long worst = 0;
+	double values[hw_count];
+	counters.start();
+	while( cursor.batches < 4 ) {
+		unsigned long long start = wall_nanoseconds();
+		if( run_budget( f, cursor, count, 0, start + budget ) == budget_failed )
+		{
+			printf("budget   entry point cannot run in a batch\r\n");
+			return;
+		}
+		unsigned long long elapsed = wall_nanoseconds() - start;
+		worst = elapsed > worst ? elapsed : worst;
+	}
+	counters.stop(values);
+	printf("budget   %5.2f frames per batch  %3u of %3u frames over  slowest %6.3f ms of %6.3f ms\r\n", (double)cursor.calls / cursor.batches, 
+		cursor.overruns, cursor.calls, worst * 1e-6, budget * 1e-6);
+	report_counters("budget", "batch", (double)cursor.particles, values);
+}
+
+// Times the update of a pool in which every particle lives for a random
+// number of frames, most of the time goes to removing the dead ones.
+static void bench_pool(hw_counters& counters, unsigned int count)
+{
+	const char* source = 
+		"void spawn()\n{\n"
+		"\tvarying float age, life;\n"
+		"\tvarying vec3 position;\n"
+		"\tlife = rand(1, 8)\n"
+		"}\n"
+		"void update()\n{\n"
+		"\tage = age + 1.0\n"
+		"\tposition.y = position.y + 0.1\n"
+		"\tif( life < age )\n\t{\n\t\tdead = 1.0\n\t}\n"
+		"}\n";
+
+	function f;
+	compile(source, strlen(source), f);
+	particle_pool pool(f, count, "dead");
+	int spawn = f.entry_point("spawn"), update = f.entry_point("update");
+	pool.emit(count, spawn);
+
+	unsigned int updated = 0;
+	double values[hw_count];
+	counters.start();
+	clock_t start = clock();
+	for( int frame = 0; frame < 16; ++frame ) {
+		updated += pool.size();
+		pool.update(update);
+		pool.emit(count / 8, spawn);
+	}
+	double elapsed = seconds(start);
+	counters.stop(values);
+	printf("particles %7u alive  %8.2f ns per particle\r\n", pool.size(), updated ? elapsed * 1e9 / updated : 0.0);
+	report_counters("pool", "update", updated ? updated : 1, values);
+}
+
+// Times 256 emitters of a few thousand particles, first updating every one
+// of them on every frame and then with three quarters of them spread over
+// the slower tiers, and reports the busiest and the quietest frame.
+static void bench_emitters(hw_counters& counters, unsigned int count)
+{
+	const char* source = 
+		"void update()\n{\n"
+		"\tuniform float dt;\n"
+		"\tvarying float age;\n"
+		"\tvarying vec3 position, velocity;\n"
+		"\tage = age + dt\n"
+		"\tvelocity.y = velocity.y - (9.8 * dt)\n"
+		"\tposition = position + (velocity * dt)\n"
+		"\tif( age > 60.0 )\n\t{\n\t\tdead = 1.0\n\t}\n"
+		"}\n";
+
+	const unsigned int emitters = 256;
+	unsigned int size = count / emitters > PEL_LANES ? count / emitters : PEL_LANES;
+	std::vector<function> programs( emitters );
+	std::vector<particle_pool*> pools( emitters );
+	for( unsigned int i = 0; i < emitters; ++i ) {
+		compile(source, strlen(source), programs[i]);
+		pools[i] = new particle_pool(programs[i], size, "dead");
+		pools[i]->emit( size / 2 + rand() % (size / 2), 0 );
+	}
+
+	for( unsigned int lod = 0; lod < 2; ++lod ) {
+		emitter_scheduler scheduler;
+		for( unsigned int i = 0; i < emitters; ++i ) {
+			scheduler.add( *pools[i], 0, lod ? i % PEL_TIERS : 0 );
+		}
+
+		unsigned int updated = 0, busiest = 0, quietest = ~0u;
+		double values[hw_count];
+		counters.start();
+		double start = wall_seconds();
+		for( int frame = 0; frame < 32; ++frame ) {
+			unsigned int n = scheduler.update( 1.0f / 60.0f, 1 );
+			updated += n;
+			busiest = n > busiest ? n : busiest;
+			quietest = n < quietest ? n : quietest;
+		}
+		double elapsed = wall_seconds() - start;
+		counters.stop(values);
+		printf("emitters %s  %8.3f ms per frame  busiest %7u  quietest %7u particles\r\n", lod ? "tiers    " : "per frame", 
+			elapsed * 1e3 / 32, busiest, quietest);
+		report_counters("emitters", lod ? "tiers" : "per frame", updated ? updated : 1, values);
+	}
+
+	for( unsigned int i = 0; i < emitters; ++i ) {
+		delete pools[i];
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int count = argc > 1 ? atoi(argv[1]) : 1 << 20;
+	count = (count + PEL_LANES - 1) / PEL_LANES * PEL_LANES;
+
+	std::vector<float> points(count * 3);
+	for( unsigned int i = 0; i < count * 3; ++i ) {
+		points[i] = (float)rand() / RAND_MAX * 64.0f - 32.0f;
+	}
+
+	#ifdef PEL_AVX2
+	printf("%d points, AVX2\r\n", count);
+	#else
+	printf("%d points, portable\r\n", count);
+	#endif
+	hw_counters counters;
+	if( counters.available() == false )
+	{
+		printf("counters unavailable\r\n");
+	}
+
+	bench_noise(counters, 1, points, count);
+	bench_noise(counters, 2, points, count);
+	bench_noise(counters, 3, points, count);
+	bench_curl(counters, points, count);
+	bench_program(counters, count);
+	bench_formats(counters, count);
+	bench_parallel(counters, count);
+	bench_budget(counters, count);
+	bench_pool(counters, count);
+	bench_emitters(counters, count);
+	bench_counters(counters, count);
+	bench_compile(100000);
+	bench_footprint(16);
+	bench_footprint(1000);
+	return 0;
+}
@@ -0,0 +1,293 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+#include <math.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "lanes.h"
+#include "opcodes.h"
+
+// Scalar builtins of the language and the natives a host registers. Every
+// entry describes how the compiler checks, folds and emits a call and how
+// both interpreters run it, so a new builtin needs nothing but its entry.
+
+// Largest number of arguments a builtin can take.
+#define PEL_BUILTIN_ARGS 8
+
+inline float op_sin(float a)		{ return sinf(a); }
+inline float op_cos(float a)		{ return cosf(a); }
+inline float op_tan(float a)		{ return tanf(a); }
+inline float op_sinh(float a)		{ return sinhf(a); }
+inline float op_cosh(float a)		{ return coshf(a); }
+inline float op_tanh(float a)		{ return tanhf(a); }
+inline float op_asin(float a)		{ return asinf(a); }
+inline float op_acos(float a)		{ return acosf(a); }
+inline float op_atan(float a)		{ return atanf(a); }
+inline float op_sqrt(float a)		{ return sqrtf(a); }
+inline float op_abs(float a)		{ return fabsf(a); }
+inline float op_ceil(float a)		{ return ceilf(a); }
+inline float op_floor(float a)		{ return floorf(a); }
+
+inline float op_sign(float a)
+{
+	return a < 0 ? -1.0f : 1.0f;
+}
+
+inline float op_radians(float a)
+{
+	return (3.14159265358979323846f * a) / 180.0f;
+}
+
+inline float op_degrees(float a)
+{
+	return (180 * a) / 3.14159265358979323846f;
+}
+
+inline float op_round(float a)
+{
+	return a < 0.0f ? ceilf(a - 0.5f) : floorf(a + 0.5f);
+}
+
+inline float op_clamp(float a, float b, float c)
+{
+	return c > b ? b : ( c < a ? a : c );
+}
+
+inline float op_lerp(float a, float b, float c)
+{
+	float d = c > 1.0f ? 1.0f : ( c < 0.0f ? 0.0f : c );
+	return a + (b - a) * d;
+}
+
+inline float op_smoothstep(float a, float b, float c)
+{
+	float r = (c - a) / (b - a);
+	float t = r > 1.0f ? 1.0f : ( r < 0.0f ? 0.0f : r );
+	return t * t * (3.0f - 2.0f * t);
+}
+
+inline float op_rand(float a, float b)
+{
+	return (float)( (double)rand()/(double)RAND_MAX * (b - a) + a );
+}
+
+// Runs a builtin for one particle, a holds the arguments in order.
+typedef float (*builtin_scalar)(const float* a);
+
+// Runs a builtin for all PEL_LANES lanes at once, a holds the arguments in
+// order.
+typedef void (*builtin_lanes)(const lanes* a, lanes& out);
+
+struct builtin
+{
+	std::string name;
+	unsigned int arity;
+	// Pure builtins return the same value for the same arguments, calls
+	// with literal arguments are folded and calls with uniform arguments
+	// are hoisted into the prologue.
+	bool pure;
+	// The instruction that runs the builtin, e_native for natives.
+	unsigned char opcode;
+	// Runs the builtin in the scalar interpreter and folds calls to it.
+	builtin_scalar scalar;
+	// Runs the builtin in the batch interpreter. Optional for natives, when
+	// it is null scalar runs once per lane. Builtins that are not pure only
+	// run it on groups in which every lane is alive, the lanes past the end
+	// of a batch run scalar.
+	builtin_lanes simd;
+};
+
+// The builtins by name, lookups go through an open addressed hash table.
+// Entries are never removed so their index can be stored in bytecode.
+class builtin_registry
+{
+	std::vector<builtin> entries;
+	std::vector<int> slots;
+	// Entry of every opcode, -1 for those that run no builtin.
+	int opcodes[256];
+
+	static unsigned int hash(const std::string& name)
+	{
+		unsigned int h = 2166136261u;
+		for( unsigned int i = 0; i < name.size(); ++i ) {
+			h = (h ^ (unsigned char)name[i]) * 16777619u;
+		}
+		return h;
+	}
+
+	void rehash(unsigned int size)
+	{
+		slots.assign(size, -1);
+		for( unsigned int i = 0; i < entries.size(); ++i ) {
+			unsigned int k = hash(entries[i].name) & (size - 1);
+			while( slots[k] >= 0 ) {
+				k = (k + 1) & (size - 1);
+			}
+			slots[k] = i;
+		}
+	}
+
+public:
+	builtin_registry()
+	{
+		for( int i = 0; i < 256; ++i ) {
+			opcodes[i] = -1;
+		}
+	}
+
+	// Index of a builtin, or -1 when there is none with that name.
+	int find(const std::string& name) const
+	{
+		if( slots.empty() )
+		{
+			return -1;
+		}
+
+		unsigned int mask = slots.size() - 1;
+		for( unsigned int k = hash(name) & mask; slots[k] >= 0; k = (k + 1) & mask ) {
+			if( entries[slots[k]].name == name )
+			{
+				return slots[k];
+			}
+		}
+
+		return -1;
+	}
+
+	// Adds a builtin and returns its index, or -1 when the name is taken or
+	// it has too many arguments.
+	int add(const std::string& name, unsigned int arity, bool pure, unsigned char opcode, builtin_scalar scalar, builtin_lanes simd = 0)
+	{
+		if( find(name) >= 0 || arity > PEL_BUILTIN_ARGS || scalar == 0 )
+		{
+			return -1;
+		}
+
+		builtin b;
+		b.name = name;
+		b.arity = arity;
+		b.pure = pure;
+		b.opcode = opcode;
+		b.scalar = scalar;
+		b.simd = simd;
+		entries.push_back(b);
+		if( opcode != e_native )
+		{
+			opcodes[opcode] = entries.size() - 1;
+		}
+
+		//The table is kept at most half full.
+		if( entries.size() * 2 > slots.size() )
+		{
+			rehash( slots.empty() ? 64 : slots.size() * 2 );
+		}
+		else
+		{
+			unsigned int k = hash(name) & (slots.size() - 1);
+			while( slots[k] >= 0 ) {
+				k = (k + 1) & (slots.size() - 1);
+			}
+			slots[k] = entries.size() - 1;
+		}
+
+		return entries.size() - 1;
+	}
+
+	// Registers a function of the host, scripts call it like any builtin.
+	int add_native(const std::string& name, unsigned int arity, bool pure, builtin_scalar scalar, builtin_lanes simd = 0)
+	{
+		return add(name, arity, pure, e_native, scalar, simd);
+	}
+
+	const builtin& operator[](unsigned int i) const
+	{
+		return entries[i];
+	}
+
+	// The builtin of the language an opcode runs.
+	const builtin& instruction(unsigned char opcode) const
+	{
+		assert( opcodes[opcode] >= 0 );
+		return entries[opcodes[opcode]];
+	}
+
+	unsigned int size() const
+	{
+		return entries.size();
+	}
+};
+
+// Kernels of the builtins that have their own opcode. The kernel for one
+// particle and the one for all lanes apply the same float op, so a folded
+// call, the scalar interpreter and the batch interpreter agree.
+template<float (*F)(float)> float scalar_kernel1(const float* a)
+{
+	return F(a[0]);
+}
+
+template<float (*F)(float, float)> float scalar_kernel2(const float* a)
+{
+	return F(a[0], a[1]);
+}
+
+template<float (*F)(float, float, float)> float scalar_kernel3(const float* a)
+{
+	return F(a[0], a[1], a[2]);
+}
+
+template<float (*F)(float)> void lanes_kernel1(const lanes* a, lanes& out)
+{
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		out.v[l] = F(a[0].v[l]);
+	}
+}
+
+template<float (*F)(float, float)> void lanes_kernel2(const lanes* a, lanes& out)
+{
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		out.v[l] = F(a[0].v[l], a[1].v[l]);
+	}
+}
+
+template<float (*F)(float, float, float)> void lanes_kernel3(const lanes* a, lanes& out)
+{
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		out.v[l] = F(a[0].v[l], a[1].v[l], a[2].v[l]);
+	}
+}
+
+// The registry every program is compiled against, it starts out with the
+// builtins of the language.
+inline builtin_registry& builtins()
+{
+	static builtin_registry registry;
+	if( registry.size() == 0 )
+	{
+		registry.add("sin",       1, true,  e_sin,         scalar_kernel1<op_sin>,        lanes_kernel1<op_sin>);
+		registry.add("cos",       1, true,  e_cos,         scalar_kernel1<op_cos>,        lanes_kernel1<op_cos>);
+		registry.add("tan",       1, true,  e_tan,         scalar_kernel1<op_tan>,        lanes_kernel1<op_tan>);
+		registry.add("sinh",      1, true,  e_sinh,        scalar_kernel1<op_sinh>,       lanes_kernel1<op_sinh>);
+		registry.add("cosh",      1, true,  e_cosh,        scalar_kernel1<op_cosh>,       lanes_kernel1<op_cosh>);
+		registry.add("tanh",      1, true,  e_tanh,        scalar_kernel1<op_tanh>,       lanes_kernel1<op_tanh>);
+		registry.add("asin",      1, true,  e_asin,        scalar_kernel1<op_asin>,       lanes_kernel1<op_asin>);
+		registry.add("acos",      1, true,  e_acos,        scalar_kernel1<op_acos>,       lanes_kernel1<op_acos>);
+		registry.add("atan",      1, true,  e_atan,        scalar_kernel1<op_atan>,       lanes_kernel1<op_atan>);
+		registry.add("sqrt",      1, true,  e_sqrt,        scalar_kernel1<op_sqrt>,       lanes_kernel1<op_sqrt>);
+		registry.add("abs",       1, true,  e_abs,         scalar_kernel1<op_abs>,        lanes_kernel1<op_abs>);
+		registry.add("sign",      1, true,  e_sign,        scalar_kernel1<op_sign>,       lanes_kernel1<op_sign>);
+		registry.add("radians",   1, true,  e_radians,     scalar_kernel1<op_radians>,    lanes_kernel1<op_radians>);
+		registry.add("degrees",   1, true,  e_degrees,     scalar_kernel1<op_degrees>,    lanes_kernel1<op_degrees>);
+		registry.add("ceil",      1, true,  e_ceil,        scalar_kernel1<op_ceil>,       lanes_kernel1<op_ceil>);
+		registry.add("floor",     1, true,  e_floor,       scalar_kernel1<op_floor>,      lanes_kernel1<op_floor>);
+		registry.add("round",     1, true,  e_round,       scalar_kernel1<op_round>,      lanes_kernel1<op_round>);
+		registry.add("clamp",     3, true,  e_clamp,       scalar_kernel3<op_clamp>,      lanes_kernel3<op_clamp>);
+		registry.add("lerp",      3, true,  e_lerp,        scalar_kernel3<op_lerp>,       lanes_kernel3<op_lerp>);
+		registry.add("smoothstep", 3, true,  e_smoothstep,  scalar_kernel3<op_smoothstep>, lanes_kernel3<op_smoothstep>);
+		registry.add("rand",      2, false, e_rand,        scalar_kernel2<op_rand>,       lanes_kernel2<op_rand>);
+	}
+
+	return registry;
+}
+
+#endif //BUILTINS_H
@@ -0,0 +1,218 @@
+#if !defined(Taste_ARENA_H__)
+#define Taste_ARENA_H__
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+
+// Size of the blocks an arena allocates from, larger requests get a block
+// of their own.
+#define PEL_ARENA_BLOCK 16384
+
+// Every allocation is aligned to this many bytes.
+#define PEL_ARENA_ALIGN 16
+
+// Storage class of the per thread state of the compiler.
+#if defined(_MSC_VER)
+#define PEL_THREAD_LOCAL __declspec(thread)
+#else
+#define PEL_THREAD_LOCAL __thread
+#endif
+
+// Bump allocator for everything a compilation creates: AST nodes, the
+// results of constant folding and the side tables of the code generator.
+// Nothing is freed on its own, release frees it all at once and runs the
+// finalizers of the objects that registered one, newest first.
+class Arena
+{
+	struct Block
+	{
+		Block* next;
+		size_t size;
+		size_t used;
+	};
+
+	struct Finalizer
+	{
+		Finalizer* next;
+		void (*finalize)(void*);
+	};
+
+	Block* blocks;
+	Finalizer* finalizers;
+
+	static size_t align(size_t size)
+	{
+		return (size + PEL_ARENA_ALIGN - 1) & ~(size_t)(PEL_ARENA_ALIGN - 1);
+	}
+
+	static char* data(Block* b)
+	{
+		return reinterpret_cast<char*>(b) + align(sizeof(Block));
+	}
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+public:
+	Arena() : blocks(0), finalizers(0)
+	{
+	}
+
+	~Arena()
+	{
+		release();
+		free(blocks);
+	}
+
+	// Returns size bytes that live until release. When finalize is not null
+	// it is called with the memory before the memory is released.
+	void* allocate(size_t size, void (*finalize)(void*) = 0)
+	{
+		size_t header = finalize ? align(sizeof(Finalizer)) : 0;
+		size_t needed = header + align(size);
+		if( blocks == 0 || blocks->used + needed > blocks->size )
+		{
+			size_t capacity = needed > PEL_ARENA_BLOCK ? needed : PEL_ARENA_BLOCK;
+			Block* b = static_cast<Block*>( malloc( align(sizeof(Block)) + capacity ) );
+			if( b == 0 )
+			{
+				throw std::bad_alloc();
+			}
+
+			b->size = capacity;
+			b->used = 0;
+			b->next = blocks;
+			blocks = b;
+		}
+
+		char* p = data(blocks) + blocks->used;
+		blocks->used += needed;
+		if( finalize )
+		{
+			Finalizer* f = reinterpret_cast<Finalizer*>(p);
+			f->finalize = finalize;
+			f->next = finalizers;
+			finalizers = f;
+		}
+
+		return p + header;
+	}
+
+	// Runs the finalizers and frees every block but the last one allocated,
+	// so an arena reused for the next compilation starts without calling
+	// malloc.
+	void release()
+	{
+		for( Finalizer* f = finalizers; f != 0; f = f->next ) {
+			f->finalize( reinterpret_cast<char*>(f) + align(sizeof(Finalizer)) );
+		}
+
+		finalizers = 0;
+		if( blocks != 0 )
+		{
+			Block* b = blocks->next;
+			while( b != 0 ) {
+				Block* next = b->next;
+				free(b);
+				b = next;
+			}
+
+			blocks->next = 0;
+			blocks->used = 0;
+		}
+	}
+
+	// Bytes handed out since the last release.
+	size_t size() const
+	{
+		size_t n = 0;
+		for( Block* b = blocks; b != 0; b = b->next ) {
+			n += b->used;
+		}
+
+		return n;
+	}
+
+	// The arena AST nodes are allocated from on this thread, see ArenaScope.
+	static Arena*& current()
+	{
+		static PEL_THREAD_LOCAL Arena* arena = 0;
+		return arena;
+	}
+};
+
+// Makes an arena the current one of this thread for as long as the scope 
+// lives.
+class ArenaScope
+{
+	Arena* previous;
+
+public:
+	ArenaScope(Arena& arena) : previous( Arena::current() )
+	{
+		Arena::current() = &arena;
+	}
+
+	~ArenaScope()
+	{
+		Arena::current() = previous;
+	}
+};
+
+// Standard allocator over the arena that was current when it was created,
+// or the heap when there was none. Containers that use it must be
+// destroyed before their arena is released.
+template<class T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template<class U> struct rebind { typedef ArenaAllocator<U> other; };
+
+	Arena* arena;
+
+	ArenaAllocator() : arena( Arena::current() ) {}
+	ArenaAllocator(const ArenaAllocator& a) : arena(a.arena) {}
+	template<class U> ArenaAllocator(const ArenaAllocator<U>& a) : arena(a.arena) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	size_type max_size() const { return (size_t)-1 / sizeof(T); }
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		if( arena )
+		{
+			return static_cast<pointer>( arena->allocate( n * sizeof(T) ) );
+		}
+
+		return static_cast<pointer>( ::operator new( n * sizeof(T) ) );
+	}
+
+	void deallocate(pointer p, size_type)
+	{
+		if( arena == 0 )
+		{
+			::operator delete(p);
+		}
+	}
+
+	void construct(pointer p, const T& value) { new(p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+};
+
+template<class T, class U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+
+template<class T, class U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+#endif // !defined(Taste_ARENA_H__)
@@ -56,11 +56,11 @@ void Parser::Get() {
 				
 				if( wcscmp(L"#optimizeoff", pragma.c_str()) == 0 )
 				{
-				_is_optimizing = false;
+				CompileContext::set_optimizing(false);
 				}
 				else if( wcscmp(L"#optimizeon", pragma.c_str()) == 0 )
 				{
-				_is_optimizing = true;
+				CompileContext::set_optimizing(true);
 				}  
 				
 		}
@@ -104,20 +104,32 @@ bool Parser::WeakSeparator(int n, int syFol, int repFol) {
 }
 
 void Parser::C() {
-		_is_optimizing = true; 
+		CompileContext::set_optimizing(true); ModuleExpr* module = new ModuleExpr(); 
+		while (StartOf(1)) {
+			if (StartOf(2)) {
+				Function(module);
+			} else {
+				Entry(module);
+			}
+		}
+		module->inline_functions(); module->optimize(); results = module; 
+}
+
+void Parser::Entry(ModuleExpr* module) {
 		Expect(8 /* "void" */);
 		Expect(_ident);
+		std::wstring name = t->val; 
 		Expect(_LeftParenthesis);
 		Expect(_RightParenthesis);
 		Exp* e = 0; 
 		Block(e);
-		e->optimize(); results = e; 
+		module->entryNames.push_back(name); module->entries.push_back(e); 
 }
 
 void Parser::Block(Exp*& expression) {
 		BlockExpr* expr = new BlockExpr(); 
 		Expect(22 /* "{" */);
-		while (la->kind == _ident || la->kind == 25 /* ";" */ || la->kind == 26 /* "if" */) {
+		while (StartOf(3)) {
 			Statement(expr);
 		}
 		Expect(23 /* "}" */);
@@ -134,7 +146,7 @@ void Parser::Primary(Exp*& expression) {
 			Get();
 		} else if (la->kind == _number) {
 			Get();
-		} else SynErr(28);
+		} else SynErr(39);
 		expr->literal = wasNegative ? -_wtof(t->val) :  _wtof(t->val) ; 
 }
 
@@ -171,7 +183,7 @@ void Parser::LogAndExpr(Exp*& expression) {
 void Parser::CompExpr(Exp*& expression) {
 		Exp* expr = 0; 
 		MultExpr(expr);
-		while (StartOf(1)) {
+		while (StartOf(4)) {
 			int op = 0; 
 			switch (la->kind) {
 			case 12 /* "==" */: {
@@ -257,7 +269,7 @@ void Parser::UnaryExpr(Exp*& expression) {
 		} else if (la->kind == _LeftParenthesis) {
 			Get();
 			Exp* e = 0; 
-			if (StartOf(2)) {
+			if (StartOf(5)) {
 				Expr(e);
 				expression = e; 
 			}
@@ -276,7 +288,11 @@ void Parser::UnaryExpr(Exp*& expression) {
 				Expect(_ident);
 				expr->value += t->val; 
 			}
-		} else SynErr(29);
+		} else if (la->kind == 27 /* "vec2" */ || la->kind == 28 /* "vec3" */ || la->kind == 29 /* "vec4" */) {
+			Constructor(expression);
+		} else if (la->kind == 32 /* "curve" */) {
+			Sample(expression);
+		} else SynErr(40);
 }
 
 void Parser::Call(Exp*& expression) {
@@ -288,7 +304,7 @@ void Parser::Call(Exp*& expression) {
 			Expect(_ident);
 		}
 		Expect(_LeftParenthesis);
-		if (StartOf(2)) {
+		if (StartOf(5)) {
 			Arglist(exp);
 		}
 		Expect(_RightParenthesis);
@@ -302,7 +318,7 @@ void Parser::Statement(BlockExpr* expression) {
 			Condition* cond = new Condition(); Exp *e = 0, *b = 0; 
 			Get();
 			Expect(_LeftParenthesis);
-			if (StartOf(2)) {
+			if (StartOf(5)) {
 				Expr(e);
 			}
 			Expect(_RightParenthesis);
@@ -316,7 +332,11 @@ void Parser::Statement(BlockExpr* expression) {
 			Exp* e = 0; 
 			EmbeddedStatement(e);
 			expression->statements.push_back( e ); 
-		} else SynErr(30);
+		} else if (StartOf(6)) {
+			Declaration(expression);
+		} else if (la->kind == 32 /* "curve" */) {
+			CurveDecl(expression);
+		} else SynErr(41);
 }
 
 void Parser::Arglist(CallExpr* expression) {
@@ -347,10 +367,164 @@ void Parser::Assignment(Exp*& expression) {
 }
 
 void Parser::EmbeddedStatement(Exp*& expression) {
-		while (!(la->kind == _EOF || la->kind == _ident)) {SynErr(31); Get();}
+		while (!(la->kind == _EOF || la->kind == _ident)) {SynErr(42); Get();}
 		expression = 0; 
 		Call(expression);
-		while (!(StartOf(3))) {SynErr(32); Get();}
+		while (!(StartOf(7))) {SynErr(43); Get();}
+}
+
+void Parser::Constructor(Exp*& expression) {
+		CallExpr* exp = new CallExpr(); 
+		if (la->kind == 27 /* "vec2" */) {
+			Get();
+		} else if (la->kind == 28 /* "vec3" */) {
+			Get();
+		} else if (la->kind == 29 /* "vec4" */) {
+			Get();
+		} else SynErr(44);
+		exp->functionName = t->val; 
+		Expect(_LeftParenthesis);
+		if (StartOf(5)) {
+			Arglist(exp);
+		}
+		Expect(_RightParenthesis);
+		expression = exp; 
+}
+
+void Parser::TypeName(int& width) {
+		if (la->kind == 30 /* "float" */) {
+			Get();
+			width = 1; 
+		} else if (la->kind == 27 /* "vec2" */) {
+			Get();
+			width = 2; 
+		} else if (la->kind == 28 /* "vec3" */) {
+			Get();
+			width = 3; 
+		} else if (la->kind == 29 /* "vec4" */) {
+			Get();
+			width = 4; 
+		} else SynErr(45);
+}
+
+void Parser::Declaration(BlockExpr* expression) {
+		DeclExpr* decl = new DeclExpr(); std::wstring name; 
+		if (la->kind == 33 /* "uniform" */ || la->kind == 34 /* "varying" */) {
+			Qualifier(decl->storage);
+		}
+		if (la->kind == 35 /* "half" */ || la->kind == 36 /* "unorm8" */ || la->kind == 37 /* "snorm16" */) {
+			Format(decl->format);
+		}
+		TypeName(decl->width);
+		Expect(_ident);
+		name = t->val; 
+		while (la->kind == _dot) {
+			Get();
+			name += t->val; 
+			Expect(_ident);
+			name += t->val; 
+		}
+		decl->names.push_back(name); 
+		while (la->kind == 24 /* "," */) {
+			Get();
+			Expect(_ident);
+			name = t->val; 
+			while (la->kind == _dot) {
+				Get();
+				name += t->val; 
+				Expect(_ident);
+				name += t->val; 
+			}
+			decl->names.push_back(name); 
+		}
+		Expect(25 /* ";" */);
+		expression->statements.push_back( decl ); 
+}
+
+void Parser::Function(ModuleExpr* module) {
+		FunctionExpr* f = new FunctionExpr(); Exp* e = 0; int width = 1; 
+		TypeName(f->width);
+		Expect(_ident);
+		f->name = t->val; 
+		Expect(_LeftParenthesis);
+		if (StartOf(2)) {
+			TypeName(width);
+			Expect(_ident);
+			f->params.push_back(t->val); f->paramWidths.push_back(width); 
+			while (la->kind == 24 /* "," */) {
+				Get();
+				TypeName(width);
+				Expect(_ident);
+				f->params.push_back(t->val); f->paramWidths.push_back(width); 
+			}
+		}
+		Expect(_RightParenthesis);
+		Expect(22 /* "{" */);
+		while (la->kind == _ident || la->kind == 25 /* ";" */) {
+			if (la->kind == 25 /* ";" */) {
+				Get();
+			} else {
+				Assignment(e);
+				f->locals.push_back( static_cast<AssignExpr*>(e) ); 
+			}
+		}
+		Expect(31 /* "return" */);
+		Expr(e);
+		f->result = e; 
+		Expect(25 /* ";" */);
+		Expect(23 /* "}" */);
+		module->functions.push_back(f); 
+}
+
+void Parser::Sample(Exp*& expression) {
+		CallExpr* exp = new CallExpr(); 
+		Expect(32 /* "curve" */);
+		exp->functionName = t->val; 
+		Expect(_LeftParenthesis);
+		Arglist(exp);
+		Expect(_RightParenthesis);
+		expression = exp; 
+}
+
+void Parser::CurveDecl(BlockExpr* expression) {
+		CurveExpr* c = new CurveExpr(); Exp* e = 0; 
+		Expect(32 /* "curve" */);
+		Expect(_ident);
+		c->name = t->val; 
+		Expect(_LeftParenthesis);
+		Expr(e);
+		c->keys.push_back(e); 
+		while (la->kind == 24 /* "," */) {
+			Get();
+			Expr(e);
+			c->keys.push_back(e); 
+		}
+		Expect(_RightParenthesis);
+		Expect(25 /* ";" */);
+		expression->statements.push_back( c ); 
+}
+
+void Parser::Qualifier(int& storage) {
+		if (la->kind == 33 /* "uniform" */) {
+			Get();
+			storage = 1; 
+		} else if (la->kind == 34 /* "varying" */) {
+			Get();
+			storage = 2; 
+		} else SynErr(46);
+}
+
+void Parser::Format(int& format) {
+		if (la->kind == 35 /* "half" */) {
+			Get();
+			format = format_half; 
+		} else if (la->kind == 36 /* "unorm8" */) {
+			Get();
+			format = format_unorm8; 
+		} else if (la->kind == 37 /* "snorm16" */) {
+			Get();
+			format = format_snorm16; 
+		} else SynErr(47);
 }
 
 
@@ -454,7 +628,7 @@ void Parser::Parse() {
 }
 
 Parser::Parser(Scanner *scanner) {
-	maxT = 27;
+	maxT = 38;
 
 	ParserInitCaller<Parser>::CallInit(this);
 	dummyToken = NULL;
@@ -469,11 +643,15 @@ bool Parser::StartOf(int s) {
 	const bool T = true;
 	const bool x = false;
 
-	static bool set[4][29] = {
-		{T,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, x,T,T,x, x},
-		{x,x,x,x, x,x,x,x, x,x,x,x, T,T,T,T, T,T,x,x, x,x,x,x, x,x,x,x, x},
-		{x,T,T,T, T,x,x,x, x,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x},
-		{T,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, x,T,T,x, x}
+	static bool set[8][40] = {
+		{T,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, x,T,T,T, T,T,T,x, T,T,T,T, T,T,x,x},
+		{x,x,x,x, x,x,x,x, T,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, T,T,T,x, x,x,x,x, x,x,x,x},
+		{x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, T,T,T,x, x,x,x,x, x,x,x,x},
+		{x,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,T,T,T, T,T,T,x, T,T,T,T, T,T,x,x},
+		{x,x,x,x, x,x,x,x, x,x,x,x, T,T,T,T, T,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x},
+		{x,T,T,T, T,x,x,x, x,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, T,T,x,x, T,x,x,x, x,x,x,x},
+		{x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, T,T,T,x, x,T,T,T, T,T,x,x},
+		{T,T,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,x, x,x,x,T, x,T,T,T, T,T,T,x, T,T,T,T, T,T,x,x}
 	};
 
 
@@ -521,12 +699,27 @@ void Errors::SynErr(int line, int col, int n) {
 			case 24: s = coco_string_create(L"\",\" expected"); break;
 			case 25: s = coco_string_create(L"\";\" expected"); break;
 			case 26: s = coco_string_create(L"\"if\" expected"); break;
-			case 27: s = coco_string_create(L"??? expected"); break;
-			case 28: s = coco_string_create(L"invalid Primary"); break;
-			case 29: s = coco_string_create(L"invalid UnaryExpr"); break;
-			case 30: s = coco_string_create(L"invalid Statement"); break;
-			case 31: s = coco_string_create(L"this symbol not expected in EmbeddedStatement"); break;
-			case 32: s = coco_string_create(L"this symbol not expected in EmbeddedStatement"); break;
+			case 27: s = coco_string_create(L"\"vec2\" expected"); break;
+			case 28: s = coco_string_create(L"\"vec3\" expected"); break;
+			case 29: s = coco_string_create(L"\"vec4\" expected"); break;
+			case 30: s = coco_string_create(L"\"float\" expected"); break;
+			case 31: s = coco_string_create(L"\"return\" expected"); break;
+			case 32: s = coco_string_create(L"\"curve\" expected"); break;
+			case 33: s = coco_string_create(L"\"uniform\" expected"); break;
+			case 34: s = coco_string_create(L"\"varying\" expected"); break;
+			case 35: s = coco_string_create(L"\"half\" expected"); break;
+			case 36: s = coco_string_create(L"\"unorm8\" expected"); break;
+			case 37: s = coco_string_create(L"\"snorm16\" expected"); break;
+			case 38: s = coco_string_create(L"??? expected"); break;
+			case 39: s = coco_string_create(L"invalid Primary"); break;
+			case 40: s = coco_string_create(L"invalid UnaryExpr"); break;
+			case 41: s = coco_string_create(L"invalid Statement"); break;
+			case 42: s = coco_string_create(L"this symbol not expected in EmbeddedStatement"); break;
+			case 43: s = coco_string_create(L"this symbol not expected in EmbeddedStatement"); break;
+			case 44: s = coco_string_create(L"invalid Constructor"); break;
+			case 45: s = coco_string_create(L"invalid TypeName"); break;
+			case 46: s = coco_string_create(L"invalid Qualifier"); break;
+			case 47: s = coco_string_create(L"invalid Format"); break;
 
 		default:
 		{
@@ -31,12 +31,73 @@ Coco/R itself) does not fall under the GNU General Public License.
 #define Taste_COCO_PARSER_H__
 
 #include <stdarg.h>
+#include <assert.h>
 #include <math.h>
 #include <algorithm>    
 #include <vector>
 #include <string>
+#include <map>
+#include "Arena.h"
+#include "../builtins.h"
+#include "../formats.h"
 
-static bool _is_optimizing = true;
+// Function bodies with at most this many nodes are spliced into their call
+// sites, larger ones are compiled once and called.
+#define PEL_INLINE_LIMIT 24
+
+// State of one compilation. Every thread has its own current context, so
+// programs can be compiled on several threads at once, and the nodes of the
+// syntax tree are allocated from the arena of the current context.
+struct CompileContext
+{
+	Arena arena;
+	// Switched by #optimize off and on, nodes keep the setting that was
+	// active when they were created. Without a context everything is 
+	// optimized.
+	bool optimizing;
+
+	CompileContext() : optimizing(true)
+	{
+	}
+
+	static CompileContext*& current()
+	{
+		static PEL_THREAD_LOCAL CompileContext* context = 0;
+		return context;
+	}
+
+	static bool is_optimizing()
+	{
+		return current() == 0 || current()->optimizing;
+	}
+
+	static void set_optimizing(bool on)
+	{
+		if( current() != 0 )
+		{
+			current()->optimizing = on;
+		}
+	}
+};
+
+// Makes a context and its arena current on this thread for as long as the
+// scope lives.
+class CompileScope
+{
+	CompileContext* previous;
+	ArenaScope arena;
+
+public:
+	CompileScope(CompileContext& context) : previous( CompileContext::current() ), arena( context.arena )
+	{
+		CompileContext::current() = &context;
+	}
+
+	~CompileScope()
+	{
+		CompileContext::current() = previous;
+	}
+};
 
 inline void printft(int count, const char* format, ... )
 {
@@ -50,19 +111,68 @@ inline void printft(int count, const char* format, ... )
     va_end( args );	
 }
 
+// Kind of an expression node, every node type has its own kind so passes
+// can switch on it instead of trying casts one after another.
+enum exp_kind
+{
+	kind_ident,
+	kind_literal,
+	kind_condition,
+	kind_block,
+	kind_call,
+	kind_comparison,
+	kind_arithmetic,
+	kind_and,
+	kind_or,
+	kind_assign,
+	kind_decl,
+	kind_curve,
+	kind_function,
+	kind_module,
+	kind_null,
+};
+
+// Nodes are allocated from the current arena and live until it is released,
+// nodes that are replaced while optimizing are not deleted.
 struct Exp
 {
+	exp_kind kind;
 	bool canOptimize;
 	
-	Exp() { canOptimize = _is_optimizing; }
+	Exp(exp_kind k) : kind(k) { canOptimize = CompileContext::is_optimizing(); }
+	virtual ~Exp() {}
 	virtual void eval(int indent) = 0;
 	virtual Exp* optimize() = 0;
+
+	static void finalize(void* p)
+	{
+		static_cast<Exp*>(p)->~Exp();
+	}
+
+	static void* operator new(size_t size)
+	{
+		Arena* arena = Arena::current();
+		return arena ? arena->allocate(size, &Exp::finalize) : ::operator new(size);
+	}
 };
 
+// Casts e to the node type T when it is of that kind and returns 0 otherwise, 
+// like dynamic_cast without the walk over the type information.
+template<class T>
+inline T* exp_cast(Exp* e)
+{
+	return e != 0 && e->kind == T::Kind ? static_cast<T*>(e) : 0;
+}
+
 struct IdentExpr : Exp
 {
+	static const exp_kind Kind = kind_ident;
 	std::wstring value;
 
+	IdentExpr() : Exp(kind_ident)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "Field \"%ls\"\r\n", value.c_str());
@@ -76,8 +186,13 @@ struct IdentExpr : Exp
 
 struct LiteralExpr : Exp
 {
+	static const exp_kind Kind = kind_literal;
 	float literal;
 
+	LiteralExpr() : Exp(kind_literal)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "%fF\r\n", literal);
@@ -91,9 +206,14 @@ struct LiteralExpr : Exp
 
 struct Condition : Exp
 {
+	static const exp_kind Kind = kind_condition;
 	Exp* booleanExpression;
 	Exp* blockExpression;
 	
+	Condition() : Exp(kind_condition)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "conditional\r\n");
@@ -106,17 +226,13 @@ struct Condition : Exp
 		Exp* p = booleanExpression->optimize();
 		if( p ) 
 		{
-			Exp* old = booleanExpression;
 			booleanExpression = p;
-			delete old;
 		}		
 		
 		p = blockExpression->optimize();
 		if( p ) 
 		{
-			Exp* old = blockExpression;
 			blockExpression = p;
-			delete old;
 		}		
 		
 		return 0;
@@ -125,8 +241,13 @@ struct Condition : Exp
 
 struct BlockExpr : Exp
 {
+	static const exp_kind Kind = kind_block;
 	std::vector<Exp*> statements;
 	
+	BlockExpr() : Exp(kind_block)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "block\r\n");
@@ -142,9 +263,7 @@ struct BlockExpr : Exp
 			Exp* p = statements[i]->optimize();
 			if( p ) 
 			{
-				Exp* old = statements[i];
 				statements[i] = p;
-				delete old;
 			}			
 		}	
 		
@@ -154,9 +273,14 @@ struct BlockExpr : Exp
 
 struct CallExpr : Exp
 {	
+	static const exp_kind Kind = kind_call;
 	std::wstring functionName;
 	std::vector<Exp*> arguments;
 	
+	CallExpr() : Exp(kind_call)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "call method %ls %d\r\n", functionName.c_str(), 
@@ -172,277 +296,31 @@ struct CallExpr : Exp
 			Exp* p = arguments[i]->optimize();
 			if( p ) 
 			{
-				Exp* old = arguments[i];
 				arguments[i] = p;
-				delete old;
 			}			
 		}	
 		
-		if( functionName == L"sin" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = sin(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}
-
-		if( functionName == L"cos" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = cos(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"tan" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = tan(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}	
-		
-		if( functionName == L"sinh" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = sinh(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}
-
-		if( functionName == L"cosh" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = cosh(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"tanh" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = tanh(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}	
-		
-		if( functionName == L"asin" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = asin(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}
-
-		if( functionName == L"acos" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = acos(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"atan" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = atan(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}	
-		
-		if( functionName == L"sqrt" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = sqrt(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}							
-		
-		if( functionName == L"abs" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = fabs(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}	
-		
-		if( functionName == L"sign" && arguments.size() == 1 )
+		//Pure builtins with literal arguments are folded with their scalar 
+		//kernel.
+		int k = builtins().find( std::string(functionName.begin(), functionName.end()) );
+		if( k >= 0 && builtins()[k].pure && builtins()[k].arity == arguments.size() && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = literal_a->literal < 0 ? -1 : 1;
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
+			float a[PEL_BUILTIN_ARGS];
+			for( int i = 0; i < arguments.size(); ++i ) {
+				LiteralExpr* literal = exp_cast<LiteralExpr>(arguments[i]);
+				if( literal == 0 )
+				{
+					return 0;
+				}
+				a[i] = literal->literal;
 			}
-		}	
 
-		if( functionName == L"radians" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = (3.14159265358979323846f * literal_a->literal) / 180.0f;
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"degrees" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = (180 * literal_a->literal) / 3.14159265358979323846f;
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}			
-		
-		if( functionName == L"ceil" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = ceil(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"floor" && arguments.size() == 1 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			if( literal_a != 0 && canOptimize == true )
-			{
-				float result = floor(literal_a->literal);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
-		if( functionName == L"clamp" && arguments.size() == 3 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(arguments[1]);
-			LiteralExpr* literal_c = dynamic_cast<LiteralExpr*>(arguments[2]);
-			if( literal_a != 0 && literal_b != 0 && literal_c != 0 && canOptimize == true )
-			{
-				float a = literal_a->literal;
-				float b = literal_b->literal;
-				float c = literal_c->literal;
-				float result = c > b ? b : ( c < a ? a : c );
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
+			LiteralExpr* r = new LiteralExpr();
+			r->literal = builtins()[k].scalar(a);
+			r->canOptimize = true;
+			return r;
 		}
 		
-		if( functionName == L"lerp" && arguments.size() == 3 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(arguments[1]);
-			LiteralExpr* literal_c = dynamic_cast<LiteralExpr*>(arguments[2]);
-			if( literal_a != 0 && literal_b != 0 && literal_c != 0 && canOptimize == true )
-			{
-				float a = literal_a->literal;
-				float b = literal_b->literal;
-				float c = literal_c->literal;
-				float result = c > 1.0f ? 1.0f : ( c < 0.0f ? 0.0f : c );
-					  result = a + (b - a) * result;
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}				
-		
-		if( functionName == L"smoothstep" && arguments.size() == 3 )
-		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(arguments[0]);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(arguments[1]);
-			LiteralExpr* literal_c = dynamic_cast<LiteralExpr*>(arguments[2]);
-			if( literal_a != 0 && literal_b != 0 && literal_c != 0 && canOptimize == true )
-			{
-				float a = literal_a->literal;
-				float b = literal_b->literal;
-				float c = literal_c->literal;
-				float result = (c - a) / (b - a);
-					  result = result > 1.0f ? 1.0f : ( result < 0.0f ? 0.0f : result );
-					  result = result * result * (3.0 - 2.0 * result);
-				LiteralExpr* r = new LiteralExpr();
-				r->literal = result;
-				r->canOptimize = true;
-				return r;			
-			}
-		}		
-		
 		return 0;
 	}
 };
@@ -450,11 +328,12 @@ struct CallExpr : Exp
 
 struct ComparisonExp : Exp
 {	
+	static const exp_kind Kind = kind_comparison;
 	int  op;
 	Exp* a;
 	Exp* b;
 	
-	ComparisonExp() : op(0)
+	ComparisonExp() : Exp(kind_comparison), op(0)
 	{
 	}
 
@@ -480,17 +359,13 @@ struct ComparisonExp : Exp
 		Exp* a1 = a->optimize();
 		if( a1 ) 
 		{
-			Exp* old = a;
 			a = a1;
-			delete old;
 		}
 		
 		Exp* b1 = b->optimize();
 		if( b1 ) 
 		{
-			Exp* old = b;
 			b = b1;
-			delete old;
 		}			
 		
 		return 0;	
@@ -500,11 +375,12 @@ struct ComparisonExp : Exp
 
 struct ArthimeticExp : Exp
 {	
+	static const exp_kind Kind = kind_arithmetic;
 	int  op;
 	Exp* a;
 	Exp* b;
 	
-	ArthimeticExp() : op(0)
+	ArthimeticExp() : Exp(kind_arithmetic), op(0)
 	{
 	}
 
@@ -530,23 +406,19 @@ struct ArthimeticExp : Exp
 		Exp* a1 = a->optimize();
 		if( a1 ) 
 		{
-			Exp* old = a;
 			a = a1;
-			delete old;
 		}
 		
 		Exp* b1 = b->optimize();
 		if( b1 ) 
 		{
-			Exp* old = b;
 			b = b1;
-			delete old;
 		}
 		
 		if( op == 1 && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(a);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(b);
+			LiteralExpr* literal_a = exp_cast<LiteralExpr>(a);
+			LiteralExpr* literal_b = exp_cast<LiteralExpr>(b);
 			if( literal_a && literal_b ) 
 			{
 				float result = literal_a->literal + literal_b->literal;																
@@ -559,8 +431,8 @@ struct ArthimeticExp : Exp
 		
 		else if( op == 2 && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(a);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(b);
+			LiteralExpr* literal_a = exp_cast<LiteralExpr>(a);
+			LiteralExpr* literal_b = exp_cast<LiteralExpr>(b);
 			if( literal_a && literal_b ) 
 			{
 				float result = literal_a->literal - literal_b->literal;																
@@ -573,8 +445,8 @@ struct ArthimeticExp : Exp
 		
 		else if( op == 3 && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(a);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(b);
+			LiteralExpr* literal_a = exp_cast<LiteralExpr>(a);
+			LiteralExpr* literal_b = exp_cast<LiteralExpr>(b);
 			if( literal_a && literal_b ) 
 			{
 				float result = literal_a->literal * literal_b->literal;																
@@ -587,8 +459,8 @@ struct ArthimeticExp : Exp
 		
 		else if( op == 4 && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(a);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(b);
+			LiteralExpr* literal_a = exp_cast<LiteralExpr>(a);
+			LiteralExpr* literal_b = exp_cast<LiteralExpr>(b);
 			if( literal_a && literal_b ) 
 			{
 				float result = literal_a->literal / literal_b->literal;																
@@ -601,8 +473,8 @@ struct ArthimeticExp : Exp
 		
 		else if( op == 5 && canOptimize == true )
 		{
-			LiteralExpr* literal_a = dynamic_cast<LiteralExpr*>(a);
-			LiteralExpr* literal_b = dynamic_cast<LiteralExpr*>(b);
+			LiteralExpr* literal_a = exp_cast<LiteralExpr>(a);
+			LiteralExpr* literal_b = exp_cast<LiteralExpr>(b);
 			if( literal_a && literal_b ) 
 			{
 				float result = fmodf( literal_a->literal, literal_b->literal );
@@ -620,9 +492,14 @@ struct ArthimeticExp : Exp
 
 struct AndExpr : Exp
 {
+	static const exp_kind Kind = kind_and;
 	Exp* a;
 	Exp* b;
 
+	AndExpr() : Exp(kind_and)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "&&\r\n");		
@@ -635,17 +512,13 @@ struct AndExpr : Exp
 		Exp* a1 = a->optimize();
 		if( a1 ) 
 		{
-			Exp* old = a;
 			a = a1;
-			delete old;
 		}
 		
 		Exp* b1 = b->optimize();
 		if( b1 ) 
 		{
-			Exp* old = b;
 			b = b1;
-			delete old;
 		}
 		return 0;
 	}
@@ -653,9 +526,14 @@ struct AndExpr : Exp
 
 struct OrExpr : Exp
 {
+	static const exp_kind Kind = kind_or;
 	Exp* a;
 	Exp* b;
 
+	OrExpr() : Exp(kind_or)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "||\r\n");		
@@ -668,17 +546,13 @@ struct OrExpr : Exp
 		Exp* a1 = a->optimize();
 		if( a1 ) 
 		{
-			Exp* old = a;
 			a = a1;
-			delete old;
 		}
 		
 		Exp* b1 = b->optimize();
 		if( b1 ) 
 		{
-			Exp* old = b;
 			b = b1;
-			delete old;
 		}
 		return false;
 	}
@@ -686,9 +560,14 @@ struct OrExpr : Exp
 
 struct AssignExpr : Exp
 {
+	static const exp_kind Kind = kind_assign;
 	std::wstring value;
 	Exp*		 exp;
 
+	AssignExpr() : Exp(kind_assign)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "assign to %ls\r\n", value.c_str(), exp );
@@ -700,17 +579,372 @@ struct AssignExpr : Exp
 		Exp* p = exp->optimize();
 		if( p ) 
 		{
-			Exp* old = exp;
 			exp = p;
-			delete old;
 		}
 		
 		return 0;
 	}
 };
 
+// Storage of a declared field, uniform fields hold one value for the whole
+// emitter and varying fields one value per particle.
+enum field_storage
+{
+	storage_default,
+	storage_uniform,
+	storage_varying,
+};
+
+struct DeclExpr : Exp
+{
+	static const exp_kind Kind = kind_decl;
+	int width;
+	int storage;
+	// How the field is stored in host memory, see field_format.
+	int format;
+	std::vector<std::wstring> names;
+
+	DeclExpr() : Exp(kind_decl), width(1), storage(storage_default), format(format_float)
+	{
+	}
+
+	virtual void eval(int indent) 
+	{
+		static const char* storages[] = { "", "uniform ", "varying " };
+		static const char* formats[] = { "", "half ", "unorm8 ", "snorm16 " };
+		for( int i = 0; i < names.size(); ++i ) {
+			if( width == 1 )
+				printft(indent, "declare %s%sfloat %ls\r\n", storages[storage], formats[format], names[i].c_str());
+			else
+				printft(indent, "declare %s%svec%d %ls\r\n", storages[storage], formats[format], width, names[i].c_str());
+		}
+	}
+	
+	virtual Exp* optimize() 
+	{
+		return 0;
+	}
+};
+
+// Declares a curve or gradient, keys alternate a time and a value. The 
+// values are floats or vector constructors and are baked into a lookup 
+// table when the program is compiled.
+struct CurveExpr : Exp
+{
+	static const exp_kind Kind = kind_curve;
+	std::wstring name;
+	std::vector<Exp*> keys;
+
+	CurveExpr() : Exp(kind_curve)
+	{
+	}
+
+	virtual void eval(int indent) 
+	{
+		printft(indent, "declare curve %ls %u\r\n", name.c_str(), (unsigned int)(keys.size() / 2));
+		for( int i = 0; i < keys.size(); ++i ) {
+			keys[i]->eval(indent + 1);
+		}
+	}
+	
+	virtual Exp* optimize() 
+	{
+		for( int i = 0; i < keys.size(); ++i ) {					
+			Exp* p = keys[i]->optimize();
+			if( p ) 
+			{
+				keys[i] = p;
+			}			
+		}	
+		return 0;
+	}
+};
+
+struct FunctionExpr : Exp
+{
+	static const exp_kind Kind = kind_function;
+	std::wstring name;
+	int width;
+	std::vector<std::wstring> params;
+	std::vector<int> paramWidths;
+	std::vector<AssignExpr*> locals;
+	Exp* result;
+
+	FunctionExpr() : Exp(kind_function), width(1), result(0)
+	{
+	}
+
+	virtual void eval(int indent) 
+	{
+		printft(indent, "function %ls %u\r\n", name.c_str(), (unsigned int)params.size());
+		for( int i = 0; i < locals.size(); ++i ) {
+			locals[i]->eval(indent + 1);
+		}
+		printft(indent + 1, "return\r\n");
+		result->eval(indent + 2);
+	}
+	
+	virtual Exp* optimize() 
+	{
+		for( int i = 0; i < locals.size(); ++i ) {
+			locals[i]->optimize();
+		}
+		
+		Exp* p = result->optimize();
+		if( p ) 
+		{
+			result = p;
+		}
+		return 0;
+	}
+
+	int uses(const std::wstring& variable, int from = 0);
+};
+
+// Number of nodes in an expression tree.
+inline int expr_size(Exp* e)
+{
+	if( ArthimeticExp* a = exp_cast<ArthimeticExp>(e) ) return 1 + expr_size(a->a) + expr_size(a->b);
+	if( ComparisonExp* a = exp_cast<ComparisonExp>(e) ) return 1 + expr_size(a->a) + expr_size(a->b);
+	if( AndExpr* a = exp_cast<AndExpr>(e) ) return 1 + expr_size(a->a) + expr_size(a->b);
+	if( OrExpr* a = exp_cast<OrExpr>(e) ) return 1 + expr_size(a->a) + expr_size(a->b);
+	if( CallExpr* a = exp_cast<CallExpr>(e) ) 
+	{
+		int n = 1;
+		for( int i = 0; i < a->arguments.size(); ++i ) {
+			n += expr_size(a->arguments[i]);
+		}
+		return n;
+	}
+	return 1;
+}
+
+// Number of times a name is read in an expression tree.
+inline int expr_uses(Exp* e, const std::wstring& variable)
+{
+	if( IdentExpr* a = exp_cast<IdentExpr>(e) ) return a->value == variable ? 1 : 0;
+	if( ArthimeticExp* a = exp_cast<ArthimeticExp>(e) ) return expr_uses(a->a, variable) + expr_uses(a->b, variable);
+	if( ComparisonExp* a = exp_cast<ComparisonExp>(e) ) return expr_uses(a->a, variable) + expr_uses(a->b, variable);
+	if( AndExpr* a = exp_cast<AndExpr>(e) ) return expr_uses(a->a, variable) + expr_uses(a->b, variable);
+	if( OrExpr* a = exp_cast<OrExpr>(e) ) return expr_uses(a->a, variable) + expr_uses(a->b, variable);
+	if( CallExpr* a = exp_cast<CallExpr>(e) ) 
+	{
+		int n = 0;
+		for( int i = 0; i < a->arguments.size(); ++i ) {
+			n += expr_uses(a->arguments[i], variable);
+		}
+		return n;
+	}
+	return 0;
+}
+
+// Copies an expression tree, names found in env are replaced by a copy of
+// the expression they are bound to.
+inline Exp* expr_clone(Exp* e, std::map<std::wstring, Exp*>& env)
+{
+	Exp* r = 0;
+	if( IdentExpr* a = exp_cast<IdentExpr>(e) ) 
+	{
+		std::map<std::wstring, Exp*>::iterator it = env.find(a->value);
+		if( it != env.end() )
+		{
+			std::map<std::wstring, Exp*> none;
+			return expr_clone(it->second, none);
+		}
+		IdentExpr* c = new IdentExpr(); c->value = a->value; r = c;
+	}
+	else if( LiteralExpr* a = exp_cast<LiteralExpr>(e) ) 
+	{
+		LiteralExpr* c = new LiteralExpr(); c->literal = a->literal; r = c;
+	}
+	else if( ArthimeticExp* a = exp_cast<ArthimeticExp>(e) ) 
+	{
+		ArthimeticExp* c = new ArthimeticExp(); c->op = a->op; c->a = expr_clone(a->a, env); c->b = expr_clone(a->b, env); r = c;
+	}
+	else if( ComparisonExp* a = exp_cast<ComparisonExp>(e) ) 
+	{
+		ComparisonExp* c = new ComparisonExp(); c->op = a->op; c->a = expr_clone(a->a, env); c->b = expr_clone(a->b, env); r = c;
+	}
+	else if( AndExpr* a = exp_cast<AndExpr>(e) ) 
+	{
+		AndExpr* c = new AndExpr(); c->a = expr_clone(a->a, env); c->b = expr_clone(a->b, env); r = c;
+	}
+	else if( OrExpr* a = exp_cast<OrExpr>(e) ) 
+	{
+		OrExpr* c = new OrExpr(); c->a = expr_clone(a->a, env); c->b = expr_clone(a->b, env); r = c;
+	}
+	else if( CallExpr* a = exp_cast<CallExpr>(e) ) 
+	{
+		CallExpr* c = new CallExpr(); c->functionName = a->functionName;
+		for( int i = 0; i < a->arguments.size(); ++i ) {
+			c->arguments.push_back( expr_clone(a->arguments[i], env) );
+		}
+		r = c;
+	}
+	else
+	{
+		assert(false);
+		return 0;
+	}
+
+	r->canOptimize = e->canOptimize;
+	return r;
+}
+
+inline int FunctionExpr::uses(const std::wstring& variable, int from)
+{
+	int n = expr_uses(result, variable);
+	for( int i = from; i < locals.size(); ++i ) {
+		n += expr_uses(locals[i]->exp, variable);
+	}
+	return n;
+}
+
+// A compiled module, the functions and the entry points (void functions 
+// such as spawn, update or death) that the host runs.
+struct ModuleExpr : Exp
+{
+	static const exp_kind Kind = kind_module;
+	std::vector<FunctionExpr*> functions;
+	std::vector<std::wstring> entryNames;
+	std::vector<Exp*> entries;
+
+	ModuleExpr() : Exp(kind_module)
+	{
+	}
+
+	virtual void eval(int indent) 
+	{
+		printft(indent, "module\r\n");
+		for( int i = 0; i < functions.size(); ++i ) {
+			functions[i]->eval(indent + 1);
+		}
+		for( int i = 0; i < entries.size(); ++i ) {
+			printft(indent + 1, "entry %ls\r\n", entryNames[i].c_str());
+			entries[i]->eval(indent + 2);
+		}
+	}
+	
+	virtual Exp* optimize() 
+	{
+		for( int i = 0; i < functions.size(); ++i ) {
+			functions[i]->optimize();
+		}
+		for( int i = 0; i < entries.size(); ++i ) {
+			entries[i]->optimize();
+		}
+		return 0;
+	}
+
+	FunctionExpr* find(const std::wstring& name, int count)
+	{
+		for( int i = 0; i < count; ++i ) {
+			if( functions[i]->name == name )
+				return functions[i];
+		}
+		return 0;
+	}
+
+	// Splices small function bodies into their call sites. Functions can only
+	// call functions declared before them, so their bodies are inlined in 
+	// declaration order and the entry points last.
+	void inline_functions()
+	{
+		for( int i = 0; i < functions.size(); ++i ) {
+			for( int j = 0; j < functions[i]->locals.size(); ++j ) {
+				inline_calls(functions[i]->locals[j]->exp, i);
+			}
+			inline_calls(functions[i]->result, i);
+		}
+		for( int i = 0; i < entries.size(); ++i ) {
+			inline_calls(entries[i], functions.size());
+		}
+	}
+
+private:
+	static bool cheap(Exp* e)
+	{
+		return exp_cast<LiteralExpr>(e) || exp_cast<IdentExpr>(e);
+	}
+
+	void inline_calls(Exp*& e, int visible)
+	{
+		if( BlockExpr* a = exp_cast<BlockExpr>(e) )
+		{
+			for( int i = 0; i < a->statements.size(); ++i ) {
+				inline_calls(a->statements[i], visible);
+			}
+		}
+		else if( Condition* a = exp_cast<Condition>(e) ) 
+		{
+			inline_calls(a->booleanExpression, visible);
+			inline_calls(a->blockExpression, visible);
+		}
+		else if( AssignExpr* a = exp_cast<AssignExpr>(e) ) inline_calls(a->exp, visible);
+		else if( ArthimeticExp* a = exp_cast<ArthimeticExp>(e) ) { inline_calls(a->a, visible); inline_calls(a->b, visible); }
+		else if( ComparisonExp* a = exp_cast<ComparisonExp>(e) ) { inline_calls(a->a, visible); inline_calls(a->b, visible); }
+		else if( AndExpr* a = exp_cast<AndExpr>(e) ) { inline_calls(a->a, visible); inline_calls(a->b, visible); }
+		else if( OrExpr* a = exp_cast<OrExpr>(e) ) { inline_calls(a->a, visible); inline_calls(a->b, visible); }
+		else if( CallExpr* a = exp_cast<CallExpr>(e) ) 
+		{
+			for( int i = 0; i < a->arguments.size(); ++i ) {
+				inline_calls(a->arguments[i], visible);
+			}
+
+			FunctionExpr* f = find(a->functionName, visible);
+			Exp* r = f ? splice(f, a) : 0;
+			if( r )
+			{
+				e = r;
+			}
+		}
+	}
+
+	// Returns the body of f with the arguments of the call substituted, or 0 
+	// when the body is too large or an argument with side effects or a 
+	// non-trivial cost would have to be evaluated more than once.
+	Exp* splice(FunctionExpr* f, CallExpr* call)
+	{
+		if( call->arguments.size() != f->params.size() )
+		{
+			return 0;
+		}
+
+		std::map<std::wstring, Exp*> env;
+		for( int i = 0; i < f->params.size(); ++i ) {
+			if( !cheap(call->arguments[i]) && f->uses(f->params[i]) > 1 )
+				return 0;
+			env[f->params[i]] = call->arguments[i];
+		}
+
+		for( int i = 0; i < f->locals.size(); ++i ) {
+			//Names that are assigned more than once are left to the call.
+			if( env.count(f->locals[i]->value) )
+				return 0;
+
+			Exp* value = expr_clone(f->locals[i]->exp, env);
+			if( !cheap(value) && f->uses(f->locals[i]->value, i + 1) > 1 )
+				return 0;
+			env[f->locals[i]->value] = value;
+		}
+
+		Exp* r = expr_clone(f->result, env);
+		if( expr_size(r) > PEL_INLINE_LIMIT )
+		{
+			return 0;
+		}
+
+		return r;
+	}
+};
+
 struct NullExpr : Exp
 {
+	static const exp_kind Kind = kind_null;
+	NullExpr() : Exp(kind_null)
+	{
+	}
+
 	virtual void eval(int indent) 
 	{
 		printft(indent, "null\r\n");
@@ -752,7 +986,7 @@ private:
 		_RightParenthesis=5,
 		_assignment=6,
 		_dot=7,
-		_ppOptimize=28
+		_ppOptimize=39
 	};
 	int maxT;
 
@@ -781,8 +1015,12 @@ bool IsMethodCall()
 	Token* pt = la;	
 	if( pt->kind == _ident )
 	{			
-		while( pt->kind == _ident || pt->kind == _dot ) {
+		//Skips a dotted name, a second name right after it starts the
+		//next statement.
+		pt = scanner->Peek();
+		while( pt->kind == _dot ) {
 			pt = scanner->Peek();
+			pt = pt->kind == _ident ? scanner->Peek() : pt;
 		}
 		
 		if( pt->kind == _LeftParenthesis )
@@ -808,8 +1046,12 @@ bool IsAssignment()
 	Token* pt = la;	
 	if( pt->kind == _ident )
 	{			
-		while( pt->kind == _ident || pt->kind == _dot ) {
+		//Skips a dotted name, a second name right after it starts the
+		//next statement.
+		pt = scanner->Peek();
+		while( pt->kind == _dot ) {
 			pt = scanner->Peek();
+			pt = pt->kind == _ident ? scanner->Peek() : pt;
 		}
 		
 		if( pt->kind == _assignment )
@@ -838,6 +1080,7 @@ bool IsAssignment()
 	void SemErr(const wchar_t* msg);
 
 	void C();
+	void Entry(ModuleExpr* module);
 	void Block(Exp*& expression);
 	void Primary(Exp*& expression);
 	void Expr(Exp*& expression);
@@ -852,6 +1095,14 @@ bool IsAssignment()
 	void Arglist(CallExpr* expression);
 	void Assignment(Exp*& expression);
 	void EmbeddedStatement(Exp*& expression);
+	void Constructor(Exp*& expression);
+	void TypeName(int& width);
+	void Declaration(BlockExpr* expression);
+	void Function(ModuleExpr* module);
+	void Sample(Exp*& expression);
+	void CurveDecl(BlockExpr* expression);
+	void Qualifier(int& storage);
+	void Format(int& format);
 
 	void Parse();
 
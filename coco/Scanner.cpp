@@ -449,8 +449,8 @@ Scanner::~Scanner() {
 void Scanner::Init() {
 	EOL    = '\n';
 	eofSym = 0;
-	maxT = 27;
-	noSym = 27;
+	maxT = 38;
+	noSym = 38;
 	int i;
 	for (i = 65; i <= 90; ++i) start.set(i, 1);
 	for (i = 97; i <= 122; ++i) start.set(i, 1);
@@ -477,6 +477,17 @@ void Scanner::Init() {
 		start.set(Buffer::EoF, -1);
 	keywords.set(L"void", 8);
 	keywords.set(L"if", 26);
+	keywords.set(L"vec2", 27);
+	keywords.set(L"vec3", 28);
+	keywords.set(L"vec4", 29);
+	keywords.set(L"float", 30);
+	keywords.set(L"return", 31);
+	keywords.set(L"curve", 32);
+	keywords.set(L"uniform", 33);
+	keywords.set(L"varying", 34);
+	keywords.set(L"half", 35);
+	keywords.set(L"unorm8", 36);
+	keywords.set(L"snorm16", 37);
 
 
 	tvalLength = 128;
@@ -782,7 +793,7 @@ Token* Scanner::NextToken() {
 			else {goto case_0;}
 		case 27:
 			case_27:
-			{t->kind = 28; break;}
+			{t->kind = 39; break;}
 		case 28:
 			case_28:
 			recEnd = pos; recKind = 2;
@@ -0,0 +1,1815 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+#include "expression.h"
+#include "coco/Parser.h"
+#include "coco/Scanner.h"
+#include <wchar.h>
+#include <stdarg.h>
+#include <stack>
+#include <map>
+#include <set>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+using namespace Taste;
+
+// Generates the bytecode of a parsed module.
+class visitor
+{
+public:
+	enum pass
+	{
+		Normal,
+		Post,
+	};
+
+	std::stack<Label> trueStack;
+	std::stack<Label> falseStack;
+	//Side tables keyed by node come from the arena of the compilation when 
+	//the visitor is created inside an ArenaScope.
+	typedef std::map<Exp*, Label, std::less<Exp*>, ArenaAllocator<std::pair<Exp* const, Label> > > label_map;
+
+	label_map jmp;
+	label_map labels_0;
+	label_map labels_1;
+	label_map labels_2;
+	std::stack<bool>	operatorStack;
+	std::map<std::string, int> vectors;
+	std::map<std::string, std::pair<int, int> > frame;
+	std::map<FunctionExpr*, std::vector<Label> > calls;
+	std::map<FunctionExpr*, Label> starts;
+	std::map<std::string, std::pair<int, int> > curves;
+	std::set<std::string> uniforms;
+	std::vector<std::pair<std::string, Exp*> > hoisted;
+	std::set<Exp*, std::less<Exp*>, ArenaAllocator<Exp*> > declared;
+	//Liveness of the fields: the slots the code compiled so far has written
+	//on every path through the entry point, the slots read before they 
+	//were written and the fields the host keeps regardless.
+	std::set<Local> written;
+	std::set<Local> live;
+	std::set<std::string> exported;
+	//Slots written on some path and not read since, and the slots whose 
+	//writes were still unread when a run of an entry point ended. The host
+	//reads those after the run.
+	std::set<Local> unread;
+	std::set<Local> results;
+	//Number of waits compiled so far.
+	int waits;
+	//Fields the guarded statement being compiled reads and writes and 
+	//whether it is free of side effects, see function::incremental.
+	BlockExpr* top;
+	bool guarded;
+	bool pure;
+	std::set<Local> reads;
+	std::set<Local> writes;
+	ModuleExpr* module;
+	int visible;
+	int errors;
+
+	visitor() : waits(0), top(0), guarded(false), pure(true), module(0), visible(0), errors(0)
+	{
+	}
+
+	void visit(Exp* expression, function& v, pass x = Normal)
+	{
+		if( expression == 0 )
+		{
+			return;
+		}
+
+		switch( expression->kind )
+		{
+			case kind_block:	  visit( static_cast<BlockExpr*>(expression), v, x ); break;
+			case kind_literal:	  visit( static_cast<LiteralExpr*>(expression), v, x ); break;
+			case kind_assign:	  visit( static_cast<AssignExpr*>(expression), v, x ); break;
+			case kind_arithmetic: visit( static_cast<ArthimeticExp*>(expression), v, x ); break;
+			case kind_ident:	  visit( static_cast<IdentExpr*>(expression), v, x ); break;
+			case kind_call:		  visit( static_cast<CallExpr*>(expression), v, x ); break;
+			case kind_condition:  visit( static_cast<Condition*>(expression), v, x ); break;
+			case kind_comparison: visit( static_cast<ComparisonExp*>(expression), v, x ); break;
+			case kind_or:		  visit( static_cast<OrExpr*>(expression), v, x ); break;
+			case kind_and:		  visit( static_cast<AndExpr*>(expression), v, x ); break;
+			case kind_decl:		  visit( static_cast<DeclExpr*>(expression), v, x ); break;
+			case kind_curve:	  visit( static_cast<CurveExpr*>(expression), v, x ); break;
+			case kind_module:	  visit( static_cast<ModuleExpr*>(expression), v, x ); break;
+			default: break;
+		}
+	}
+
+private:
+	void error(const char* format, ...)
+	{
+		va_list args;
+		va_start( args, format );
+		printf( "-- " );
+		vprintf( format, args );
+		printf( "\n" );
+		va_end( args );
+		errors++;
+	}
+
+	//Index of a vector component, both xyzw and rgba are accepted.
+	static int component(char c)
+	{
+		switch( c )
+		{
+			case 'x': case 'r': return 0;
+			case 'y': case 'g': return 1;
+			case 'z': case 'b': return 2;
+			case 'w': case 'a': return 3;
+		}
+		return -1;
+	}
+
+	//Resolves a name against the declared vector fields, either the vector 
+	//itself or a swizzle of it such as position.xy or color.rgb. Single 
+	//components are ordinary scalar fields and are not resolved here.
+	bool vector_field(const std::string& name, std::string& base, int& n, int& m, unsigned int& mask)
+	{
+		std::map<std::string, int>::iterator it = vectors.find(name);
+		if( it != vectors.end() )
+		{
+			base = name; n = m = it->second; mask = 0xE4;
+			return true;
+		}
+
+		std::string::size_type dot = name.rfind('.');
+		if( dot == std::string::npos )
+		{
+			return false;
+		}
+
+		it = vectors.find(name.substr(0, dot));
+		std::string swizzle = name.substr(dot + 1);
+		if( it == vectors.end() || swizzle.size() < 2 || swizzle.size() > 4 )
+		{
+			return false;
+		}
+
+		mask = 0;
+		for( unsigned int i = 0; i < swizzle.size(); ++i ) {
+			int c = component(swizzle[i]);
+			if( c < 0 || c >= it->second )
+			{
+				return false;
+			}
+			mask |= c << (i * 2);
+		}
+
+		base = it->first; n = it->second; m = swizzle.size();
+		return true;
+	}
+
+	//Maps single components written as rgba onto the xyzw named slots.
+	std::string scalar_field(const std::string& name)
+	{
+		std::string::size_type dot = name.rfind('.');
+		if( dot != std::string::npos && dot + 2 == name.size() && vectors.count(name.substr(0, dot)) )
+		{
+			int c = component(name[dot + 1]);
+			if( c >= 0 )
+			{
+				return name.substr(0, dot + 1) + "xyzw"[c];
+			}
+		}
+		return name;
+	}
+
+	void read(Local slot, int n)
+	{
+		for( int k = 0; k < n && guarded; ++k ) {
+			reads.insert(slot + k);
+		}
+		for( int k = 0; k < n; ++k ) {
+			if( written.count(slot + k) == 0 )
+			{
+				live.insert(slot + k);
+			}
+			unread.erase(slot + k);
+		}
+	}
+
+	void write(Local slot, int n)
+	{
+		for( int k = 0; k < n && guarded; ++k ) {
+			writes.insert(slot + k);
+		}
+		for( int k = 0; k < n; ++k ) {
+			written.insert(slot + k);
+			unread.insert(slot + k);
+		}
+	}
+
+	//The run of the entry point ends here, what it wrote and did not read
+	//again is its result.
+	void finish()
+	{
+		results.insert( unread.begin(), unread.end() );
+		unread.clear();
+	}
+
+	//Classifies every field once the whole module is compiled. Fields that
+	//are read before they are written, fields a run leaves written but not
+	//read again and fields the host has to see are persistent, the rest are
+	//temporaries.
+	void classify(function& v)
+	{
+		for( Local i = 0; i < v.localNames.size(); ++i ) {
+			const std::string& name = v.localNames[i];
+			std::string::size_type dot = name.rfind('.');
+			if( (name[0] == '@' && exported.count(name) == 0) || uniform_field(name) )
+			{
+				v.il_usage(i, usage_uniform);
+			}
+			else if( live.count(i) || results.count(i) || exported.count(name) || (dot != std::string::npos && exported.count(name.substr(0, dot))) )
+			{
+				v.il_usage(i, usage_persistent);
+			}
+			else
+			{
+				v.il_usage(i, usage_temporary);
+			}
+		}
+	}
+
+	//User defined function that a call refers to, functions can only call 
+	//functions declared before them.
+	FunctionExpr* callee(CallExpr* expression)
+	{
+		return module ? module->find(expression->functionName, visible) : 0;
+	}
+
+	//Whether a call is a wait or yield statement.
+	bool suspends(CallExpr* expression)
+	{
+		return (expression->functionName == L"wait" || expression->functionName == L"yield") && callee(expression) == 0;
+	}
+
+	//Number of floats an expression leaves on the stack.
+	int width(Exp* expression)
+	{
+		if( IdentExpr* e = exp_cast<IdentExpr>(expression) )
+		{
+			std::map<std::string, std::pair<int, int> >::iterator it = frame.find( std::string(e->value.begin(), e->value.end()) );
+			if( it != frame.end() )
+			{
+				return it->second.second;
+			}
+
+			std::string base; int n = 0, m = 1; unsigned int mask = 0;
+			vector_field( std::string(e->value.begin(), e->value.end()), base, n, m, mask );
+			return m;
+		}
+		else if( ArthimeticExp* e = exp_cast<ArthimeticExp>(expression) )
+		{
+			int a = width(e->a), b = width(e->b);
+			return a > b ? a : b;
+		}
+		else if( CallExpr* e = exp_cast<CallExpr>(expression) )
+		{
+			if( FunctionExpr* f = callee(e) ) return f->width;
+			if( suspends(e) ) return 0;
+			if( e->functionName == L"vec2" ) return 2;
+			if( e->functionName == L"vec3" ) return 3;
+			if( e->functionName == L"vec4" ) return 4;
+			if( e->functionName == L"cross" || e->functionName == L"curl3" ) return 3;
+			if( e->functionName == L"normalize" && e->arguments.size() == 1 ) return width(e->arguments[0]);
+			if( e->functionName == L"curve" && e->arguments.size() == 2 )
+			{
+				IdentExpr* id = exp_cast<IdentExpr>(e->arguments[0]);
+				std::map<std::string, std::pair<int, int> >::iterator it = id ? curves.find( std::string(id->value.begin(), id->value.end()) ) : curves.end();
+				return it != curves.end() ? it->second.second : 1;
+			}
+			return 1;
+		}
+		else if( exp_cast<AssignExpr>(expression) || exp_cast<Condition>(expression) || 
+				 exp_cast<DeclExpr>(expression) || exp_cast<BlockExpr>(expression) ||
+				 exp_cast<CurveExpr>(expression) )
+		{
+			return 0;
+		}
+
+		return 1;
+	}
+
+	//Checks the arguments of a builtin, vector builtins take vectors of the
+	//same width, all others take scalars.
+	bool arguments(CallExpr* expression, unsigned int count, int n)
+	{
+		if( expression->arguments.size() != count )
+		{
+			error("%ls expects %d arguments", expression->functionName.c_str(), count);
+			return false;
+		}
+
+		for( unsigned int i = 0; i < count; ++i ) {
+			if( width(expression->arguments[i]) != n )
+			{
+				if( n == 1 )
+					error("%ls expects scalar arguments", expression->functionName.c_str());
+				else
+					error("%ls expects vec%d arguments", expression->functionName.c_str(), n);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	//Whether a field holds the same value for every particle, this includes
+	//swizzles and components of uniform vectors.
+	bool uniform_field(const std::string& name)
+	{
+		if( frame.count(name) )
+		{
+			return false;
+		}
+
+		if( uniforms.count(name) )
+		{
+			return true;
+		}
+
+		std::string::size_type dot = name.rfind('.');
+		return dot != std::string::npos && uniforms.count(name.substr(0, dot)) && vectors.count(name.substr(0, dot));
+	}
+
+	//Whether an expression has the same value for every particle, that is 
+	//it reads only literals and uniform fields and calls only builtins that
+	//have no side effects.
+	bool uniform(Exp* expression)
+	{
+		if( exp_cast<LiteralExpr>(expression) )
+		{
+			return true;
+		}
+		else if( IdentExpr* e = exp_cast<IdentExpr>(expression) )
+		{
+			return uniform_field( std::string(e->value.begin(), e->value.end()) );
+		}
+		else if( ArthimeticExp* e = exp_cast<ArthimeticExp>(expression) )
+		{
+			return uniform(e->a) && uniform(e->b);
+		}
+		else if( CallExpr* e = exp_cast<CallExpr>(expression) )
+		{
+			int k = builtins().find( std::string(e->functionName.begin(), e->functionName.end()) );
+			if( callee(e) || suspends(e) || (k >= 0 && builtins()[k].pure == false) )
+			{
+				return false;
+			}
+
+			//The first argument of curve names the curve.
+			for( int i = e->functionName == L"curve" ? 1 : 0; i < e->arguments.size(); ++i ) {
+				if( uniform(e->arguments[i]) == false )
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	//Replaces every uniform subexpression worth computing once by a hidden
+	//field, the expressions are collected in hoisted for the prologue.
+	void hoist(Exp*& expression)
+	{
+		if( expression == 0 )
+		{
+			return;
+		}
+
+		if( (exp_cast<ArthimeticExp>(expression) || exp_cast<CallExpr>(expression)) && uniform(expression) )
+		{
+			char name[32];
+			sprintf(name, "@uniform%u", (unsigned int)hoisted.size());
+			int n = width(expression);
+			if( n > 1 )
+			{
+				vectors[name] = n;
+			}
+
+			IdentExpr* e = new IdentExpr();
+			e->value.assign(name, name + strlen(name));
+			e->canOptimize = expression->canOptimize;
+			hoisted.push_back( std::make_pair(std::string(name), expression) );
+			expression = e;
+		}
+		else if( BlockExpr* e = exp_cast<BlockExpr>(expression) )
+		{
+			for( int i = 0; i < e->statements.size(); ++i ) {
+				hoist(e->statements[i]);
+			}
+		}
+		else if( Condition* e = exp_cast<Condition>(expression) )
+		{
+			hoist(e->booleanExpression);
+			hoist(e->blockExpression);
+		}
+		else if( AssignExpr* e = exp_cast<AssignExpr>(expression) )
+		{
+			hoist(e->exp);
+		}
+		else if( ArthimeticExp* e = exp_cast<ArthimeticExp>(expression) )
+		{
+			hoist(e->a);
+			hoist(e->b);
+		}
+		else if( ComparisonExp* e = exp_cast<ComparisonExp>(expression) )
+		{
+			hoist(e->a);
+			hoist(e->b);
+		}
+		else if( AndExpr* e = exp_cast<AndExpr>(expression) )
+		{
+			hoist(e->a);
+			hoist(e->b);
+		}
+		else if( OrExpr* e = exp_cast<OrExpr>(expression) )
+		{
+			hoist(e->a);
+			hoist(e->b);
+		}
+		else if( CallExpr* e = exp_cast<CallExpr>(expression) )
+		{
+			for( int i = e->functionName == L"curve" ? 1 : 0; i < e->arguments.size(); ++i ) {
+				hoist(e->arguments[i]);
+			}
+		}
+	}
+
+	//Visits the declarations of a block and the blocks nested in it ahead 
+	//of the code, so uniforms are known before anything is hoisted.
+	void declare(Exp* expression, function& v)
+	{
+		if( BlockExpr* e = exp_cast<BlockExpr>(expression) )
+		{
+			for( int i = 0; i < e->statements.size(); ++i ) {
+				declare(e->statements[i], v);
+			}
+		}
+		else if( Condition* e = exp_cast<Condition>(expression) )
+		{
+			declare(e->blockExpression, v);
+		}
+		else if( exp_cast<DeclExpr>(expression) || exp_cast<CurveExpr>(expression) )
+		{
+			visit(expression, v);
+			declared.insert(expression);
+		}
+	}
+
+	void visit(ModuleExpr* expression, function& v, pass x)
+	{
+		module = expression;
+		visible = expression->functions.size();
+
+		//Fields the host created before compiling are its own.
+		exported.insert( v.localNames.begin(), v.localNames.end() );
+
+		//All entry points share the fields, so their declarations are 
+		//visited first.
+		if( expression->entries.empty() )
+		{
+			error("module has no entry point");
+		}
+
+		for( int i = 0; i < expression->entries.size(); ++i ) {
+			for( int j = 0; j < i; ++j ) {
+				if( expression->entryNames[i] == expression->entryNames[j] )
+					error("entry point %ls is declared twice", expression->entryNames[i].c_str());
+			}
+			declare(expression->entries[i], v);
+		}
+
+		//Uniform subexpressions are computed by a prologue that runs once 
+		//per batch, the entry points read the results from hidden fields.
+		for( int i = 0; i < expression->entries.size(); ++i ) {
+			hoist(expression->entries[i]);
+		}
+		for( int i = 0; i < hoisted.size(); ++i ) {
+			int n = width(hoisted[i].second);
+			visit(hoisted[i].second, v);
+			if( n > 1 )
+			{
+				Local first = v.il_local(hoisted[i].first + ".x");
+				for( int k = 1; k < n; ++k ) {
+					v.il_local(hoisted[i].first + "." + "xyzw"[k]);
+				}
+				v.il_vsfld(first, n);
+			}
+			else
+			{
+				v.il_sfld( v.il_local(hoisted[i].first) );
+			}
+		}
+
+		if( hoisted.size() > 0 )
+		{
+			v.il_ret();
+		}
+
+		for( int i = 0; i < expression->entries.size(); ++i ) {
+			v.il_entry( std::string(expression->entryNames[i].begin(), expression->entryNames[i].end()) );
+			written.clear();
+			top = exp_cast<BlockExpr>(expression->entries[i]);
+			visit(expression->entries[i], v);
+			top = 0;
+			finish();
+
+			//A particle that reaches the end starts over on its next run.
+			if( v.states.back() >= 0 )
+			{
+				v.il_push(0.0f);
+				v.il_sfld( v.states.back() );
+			}
+			v.il_ret();
+		}
+
+		//Functions that are called rather than inlined can run at any point,
+		//every field they read counts as read before it is written.
+		written.clear();
+
+		//Functions that were not inlined follow the entry points, emitting 
+		//one can introduce calls to others.
+		for( bool emitted = true; emitted; ) {
+			emitted = false;
+			for( int i = 0; i < expression->functions.size(); ++i ) {
+				FunctionExpr* f = expression->functions[i];
+				if( calls.count(f) && !starts.count(f) )
+				{
+					visible = i;
+					visit(f, v);
+					emitted = true;
+				}
+			}
+		}
+
+		for( std::map<FunctionExpr*, std::vector<Label> >::iterator it = calls.begin(); it != calls.end(); ++it ) {
+			for( int i = 0; i < it->second.size(); ++i ) {
+				v.il_set_label_instr(it->second[i], starts[it->first]);
+			}
+		}
+
+		classify(v);
+		settle(v);
+
+		//The Post pass leaves jumps to jumps and to the next instruction.
+		if( errors == 0 )
+		{
+			v.il_thread();
+			depth(v);
+		}
+	}
+
+	//The interpreters have PEL_STACK_SIZE stack slots and room for 
+	//PEL_CALL_DEPTH nested calls, programs that would need more are 
+	//rejected.
+	void depth(function& v)
+	{
+		Label functions = v.il_functions();
+		std::map<Label, function_depth> known;
+		for( unsigned int i = 0; i <= v.entries.size(); ++i ) {
+			Label start = i ? v.entries[i - 1] : 0;
+			Label end = i < v.entries.size() ? v.entries[i] : functions;
+			unsigned int stack = 0, nested = 0;
+			v.il_depth(start, end, 0, stack, nested, known);
+			std::string name = i ? "entry point " + v.entryNames[i - 1] : "the prologue";
+			if( stack > PEL_STACK_SIZE )
+			{
+				error("%s needs %u stack slots, at most %d are available", name.c_str(), stack, PEL_STACK_SIZE);
+			}
+			if( nested > PEL_CALL_DEPTH )
+			{
+				error("%s nests %u calls, at most %d are allowed", name.c_str(), nested, PEL_CALL_DEPTH);
+			}
+		}
+	}
+
+	void visit(FunctionExpr* expression, function& v)
+	{
+		starts[expression] = v.il_get_label();
+
+		//The frame holds the arguments followed by the locals.
+		frame.clear();
+		int size = 0;
+		for( int i = 0; i < expression->params.size(); ++i ) {
+			frame[ std::string(expression->params[i].begin(), expression->params[i].end()) ] = std::make_pair(size, expression->paramWidths[i]);
+			size += expression->paramWidths[i];
+		}
+
+		int args = size;
+		for( int i = 0; i < expression->locals.size(); ++i ) {
+			std::string variable( expression->locals[i]->value.begin(), expression->locals[i]->value.end() );
+			if( frame.count(variable) == 0 )
+			{
+				frame[variable] = std::make_pair(size, width(expression->locals[i]->exp));
+				size += frame[variable].second;
+			}
+		}
+
+		if( size > args )
+		{
+			v.il_enter(size - args);
+		}
+
+		for( int i = 0; i < expression->locals.size(); ++i ) {
+			std::string variable( expression->locals[i]->value.begin(), expression->locals[i]->value.end() );
+			if( width(expression->locals[i]->exp) != frame[variable].second )
+			{
+				error("%s changes width in %ls", variable.c_str(), expression->name.c_str());
+			}
+
+			visit(expression->locals[i]->exp, v);
+			v.il_sarg(frame[variable].first, frame[variable].second);
+		}
+
+		if( width(expression->result) != expression->width )
+		{
+			error("%ls returns the wrong width", expression->name.c_str());
+		}
+
+		visit(expression->result, v);
+		v.il_retv(expression->width);
+		frame.clear();
+	}
+
+	void visit(BlockExpr* expression, function& v, pass x)
+	{		
+		for( int i = 0; i < expression->statements.size(); ++i ) {
+			CallExpr* call = exp_cast<CallExpr>(expression->statements[i]);
+			if( call && suspends(call) )
+			{
+				suspend(call, v);
+				continue;
+			}
+
+			//Assignments and conditions at the top of an entry point are 
+			//guarded when the program is compiled incrementally.
+			Exp* statement = expression->statements[i];
+			Label end = 0;
+			if( v.incremental && expression == top && (statement->kind == kind_assign || statement->kind == kind_condition) )
+			{
+				end = v.il_guard( v.guards.size() );
+				v.guards.push_back( statement_guard() );
+				v.guards.back().entry = v.entries.size() - 1;
+				guarded = true;
+				pure = true;
+				reads.clear();
+				writes.clear();
+			}
+
+			visit(statement, v);
+
+			//Pop the value from the stack.
+			for( int n = width(statement); n > 0; --n ) 
+			{
+				v.il_pop();
+			}
+
+			if( end )
+			{
+				v.il_set_label_instr( end, v.il_get_label() );
+				statement_guard& g = v.guards.back();
+				g.reads.assign( reads.begin(), reads.end() );
+				g.writes.assign( writes.begin(), writes.end() );
+				g.skippable = pure;
+				guarded = false;
+			}
+		}
+	}
+
+	//Decides which guarded statements can be skipped once the fields are 
+	//classified. A statement that reads what it writes, reads temporaries
+	//or shares a field with another statement has to run every time, as
+	//do the statements of entry points that wait, not every particle 
+	//reaches them on every run.
+	void settle(function& v)
+	{
+		std::map<Local, int> writers;
+		for( unsigned int g = 0; g < v.guards.size(); ++g ) {
+			for( unsigned int k = 0; k < v.guards[g].writes.size(); ++k ) {
+				writers[ v.guards[g].writes[k] ]++;
+			}
+		}
+
+		for( unsigned int g = 0; g < v.guards.size(); ++g ) {
+			statement_guard& s = v.guards[g];
+			s.skippable = s.skippable && s.writes.empty() == false && v.states[s.entry] < 0;
+			for( unsigned int k = 0; k < s.writes.size(); ++k ) {
+				Local w = s.writes[k];
+				s.skippable = s.skippable && writers[w] == 1 && v.usages[w] == usage_persistent && 
+					std::find(s.reads.begin(), s.reads.end(), w) == s.reads.end();
+			}
+			for( unsigned int k = 0; k < s.reads.size(); ++k ) {
+				s.skippable = s.skippable && v.usages[ s.reads[k] ] != usage_temporary;
+			}
+		}
+	}
+
+	//wait(seconds) and yield() end the run of a particle, the next run of 
+	//the entry point continues after them once the time has passed. Where
+	//a particle continues and when it wakes up are kept in two hidden 
+	//fields per entry point.
+	void suspend(CallExpr* expression, function& v)
+	{
+		bool yield = expression->functionName == L"yield";
+		if( arguments(expression, yield ? 0 : 1, 1) == false )
+		{
+			return;
+		}
+
+		if( v.states.back() < 0 )
+		{
+			std::string entry = v.entryNames.back();
+			v.il_state( v.il_local("@resume." + entry) );
+			v.il_local("@wake." + entry);
+			exported.insert("@resume." + entry);
+			exported.insert("@wake." + entry);
+		}
+
+		if( yield )
+		{
+			v.il_push(0.0f);
+		}
+		else
+		{
+			visit(expression->arguments[0], v);
+		}
+		v.il_wait( v.states.back() );
+
+		//The statements after the wait run in a later run, what the entry
+		//point wrote before is not written then.
+		finish();
+		written.clear();
+		waits++;
+		pure = false;
+	}
+
+	void visit(DeclExpr* expression, function& v, pass x)
+	{
+		if( declared.count(expression) )
+		{
+			return;
+		}
+
+		for( int i = 0; i < expression->names.size(); ++i ) {
+			std::string variable( expression->names[i].begin(), expression->names[i].end() );
+			if( expression->width == 1 )
+			{
+				v.il_format( v.il_local(variable), (field_format)expression->format );
+				continue;
+			}
+
+			//The components of a vector must occupy consecutive slots, 
+			//components that were created on their own are moved as long as
+			//no code refers to them.
+			Local first = 0, slot = 0;
+			bool consecutive = v.il_find_local(variable + ".x", first);
+			for( int k = 1; k < expression->width && consecutive; ++k ) {
+				consecutive = v.il_find_local(variable + "." + "xyzw"[k], slot) && slot == first + k;
+			}
+
+			if( consecutive == false && v.il_size() == 0 )
+			{
+				for( int k = 0; k < expression->width; ++k ) {
+					v.il_remove_local(variable + "." + "xyzw"[k]);
+				}
+			}
+
+			first = v.il_local(variable + ".x");
+			for( int k = 1; k < expression->width; ++k ) {
+				if( v.il_local(variable + "." + "xyzw"[k]) != first + k )
+				{
+					error("vector %s must be declared before its components are used", variable.c_str());
+					break;
+				}
+			}
+
+			for( int k = 0; k < expression->width; ++k ) {
+				v.il_format( first + k, (field_format)expression->format );
+			}
+
+			vectors[variable] = expression->width;
+		}
+
+		if( expression->storage == storage_uniform )
+		{
+			for( int i = 0; i < expression->names.size(); ++i ) {
+				uniforms.insert( std::string(expression->names[i].begin(), expression->names[i].end()) );
+			}
+		}
+
+		//Fields declared varying or with a storage format are kept for the 
+		//host even when the script does not need them between runs.
+		if( expression->storage == storage_varying || expression->format != format_float )
+		{
+			for( int i = 0; i < expression->names.size(); ++i ) {
+				exported.insert( std::string(expression->names[i].begin(), expression->names[i].end()) );
+			}
+		}
+	}
+
+	//Bakes the keys of a curve into a lookup table, the keys have to be 
+	//constant once the tree is optimized.
+	void visit(CurveExpr* expression, function& v, pass x)
+	{
+		if( declared.count(expression) )
+		{
+			return;
+		}
+
+		std::string name( expression->name.begin(), expression->name.end() );
+		std::vector<float> keys;
+		int n = 0;
+		if( expression->keys.size() < 2 || expression->keys.size() % 2 != 0 )
+		{
+			error("curve %s expects pairs of a time and a value", name.c_str());
+			return;
+		}
+
+		for( int i = 0; i < expression->keys.size(); i += 2 ) {
+			LiteralExpr* time = exp_cast<LiteralExpr>(expression->keys[i]);
+			LiteralExpr* literal = exp_cast<LiteralExpr>(expression->keys[i + 1]);
+			CallExpr* constructor = exp_cast<CallExpr>(expression->keys[i + 1]);
+			int m = width(expression->keys[i + 1]);
+			if( time == 0 || (literal == 0 && (constructor == 0 || constructor->arguments.size() != m)) || (n != 0 && m != n) )
+			{
+				error("key %d of curve %s is not a constant of the same width", i / 2 + 1, name.c_str());
+				return;
+			}
+
+			n = m;
+			keys.push_back( time->literal );
+			for( int k = 0; k < m; ++k ) {
+				LiteralExpr* value = literal ? literal : exp_cast<LiteralExpr>(constructor->arguments[k]);
+				if( value == 0 )
+				{
+					error("key %d of curve %s is not a constant of the same width", i / 2 + 1, name.c_str());
+					return;
+				}
+				keys.push_back( value->literal );
+			}
+		}
+
+		int index = v.bake_curve(name, &keys[0], keys.size() / (n + 1), n);
+		if( index < 0 )
+		{
+			error("keys of curve %s must have ascending times", name.c_str());
+			return;
+		}
+
+		curves[name] = std::make_pair(index, n);
+	}
+
+	void visit(LiteralExpr* expression, function& v, pass x)
+	{		
+		v.il_push( expression->literal );
+
+		/*
+		//Check if the stack needs to be popped.
+		AssignExpression* assign = dynamic_cast<AssignExpression*>(expressions[i]);
+		Conditional* cond = dynamic_cast<Conditional*>(expressions[i]);
+		if( assign == 0 && cond == 0 ) {
+			v.il_pop();
+		}
+		*/
+	}
+
+	void visit(AssignExpr* expression, function& v, pass x)
+	{		
+		std::string variable( expression->value.begin(), expression->value.end() );
+		std::string base; int n = 1, m = 1; unsigned int mask = 0;
+		int w = width(expression->exp);
+		if( uniform_field(variable) )
+		{
+			error("uniform %s cannot be assigned per particle", variable.c_str());
+			return;
+		}
+
+		if( vector_field(variable, base, n, m, mask) )
+		{
+			if( m != n || mask != 0xE4 )
+			{
+				error("cannot assign to swizzle %s", variable.c_str());
+				return;
+			}
+
+			if( w != n && w != 1 )
+			{
+				error("cannot assign vec%d to vec%d %s", w, n, variable.c_str());
+				return;
+			}
+
+			visit(expression->exp, v);
+			if( w == 1 )
+			{
+				v.il_vsplat(n);
+			}
+			v.il_vsfld( v.il_local(variable + ".x"), n );
+			write( v.il_local(variable + ".x"), n );
+			return;
+		}
+
+		if( w != 1 )
+		{
+			error("cannot assign vec%d to scalar %s", w, variable.c_str());
+			return;
+		}
+
+		visit(expression->exp, v);
+		v.il_sfld( v.il_local(scalar_field(variable)) );
+		write( v.il_local(scalar_field(variable)), 1 );
+	}
+
+
+	void visit(ArthimeticExp* expression, function& v, pass x)
+	{		
+		int a = width(expression->a), b = width(expression->b);
+		if( a > 1 && b > 1 && a != b )
+		{
+			error("vec%d and vec%d operands do not match", a, b);
+			return;
+		}
+
+		//Scalars mixed with vectors are broadcast to every component.
+		int n = a > b ? a : b;
+		visit(expression->a, v);
+		if( n > a ) v.il_vsplat(n);
+		visit(expression->b, v);
+		if( n > b ) v.il_vsplat(n);
+
+		if( n > 1 )
+		{
+			switch( expression->op )
+			{
+				case 1: v.il_vadd(n); break;
+				case 2: v.il_vsub(n); break;
+				case 3: v.il_vmul(n); break;
+				case 4: v.il_vdiv(n); break;
+				case 5: v.il_vmod(n); break;
+				default:
+					assert(false);
+					break;
+			};
+			return;
+		}
+		
+		switch( expression->op )
+		{
+			case 1:
+				v.il_add();
+				break;
+			case 2:
+				v.il_sub();
+				break;
+			case 3:
+				v.il_mul();
+				break;
+			case 4:
+				v.il_div();
+				break;
+			case 5:
+				v.il_mod();
+				break;
+			default:
+				assert(false);
+				break;
+		};
+	}
+
+	void visit(IdentExpr* expression, function& v, pass x)
+	{		
+		//Fields that are only read still get a slot so the host can bind them.
+		std::string variable( expression->value.begin(), expression->value.end() );
+		std::map<std::string, std::pair<int, int> >::iterator it = frame.find(variable);
+		if( it != frame.end() )
+		{
+			v.il_larg(it->second.first, it->second.second);
+			return;
+		}
+
+		std::string base; int n = 1, m = 1; unsigned int mask = 0;
+		if( vector_field(variable, base, n, m, mask) )
+		{
+			v.il_vlfld( v.il_local(base + ".x"), n );
+			read( v.il_local(base + ".x"), n );
+			if( m != n || mask != 0xE4 )
+			{
+				v.il_vswizzle(n, m, mask);
+			}
+			return;
+		}
+
+		v.il_lfld( v.il_local(scalar_field(variable)) );
+		read( v.il_local(scalar_field(variable)), 1 );
+	}
+
+
+
+
+
+	void visit(CallExpr* expression, function& v, pass x)
+	{		
+		if( suspends(expression) )
+		{
+			error("%ls can only be a statement of an entry point", expression->functionName.c_str());
+			return;
+		}
+		else if( FunctionExpr* f = callee(expression) )
+		{
+			pure = false;
+			if( expression->arguments.size() != f->params.size() )
+			{
+				error("%ls expects %d arguments", f->name.c_str(), f->params.size());
+				return;
+			}
+
+			int n = 0;
+			for( int i = 0; i < expression->arguments.size(); ++i ) {
+				if( width(expression->arguments[i]) != f->paramWidths[i] )
+				{
+					error("argument %d of %ls has the wrong width", i + 1, f->name.c_str());
+					return;
+				}
+				visit(expression->arguments[i], v);
+				n += f->paramWidths[i];
+			}
+
+			calls[f].push_back( v.il_call(0, n) );
+			return;
+		}
+		else if( expression->functionName == L"vec2" || expression->functionName == L"vec3" || expression->functionName == L"vec4" )
+		{
+			//The components of the arguments are simply stacked, a single 
+			//scalar is broadcast.
+			int n = width(expression), total = 0;
+			for( int i = 0; i < expression->arguments.size(); ++i ) {
+				visit(expression->arguments[i], v);
+				total += width(expression->arguments[i]);
+			}
+
+			if( expression->arguments.size() == 1 && total == 1 )
+			{
+				v.il_vsplat(n);
+			}
+			else if( total != n )
+			{
+				error("%ls expects %d components, got %d", expression->functionName.c_str(), n, total);
+			}
+			return;
+		}
+		else if( expression->functionName == L"dot" )
+		{
+			int n = expression->arguments.size() == 2 ? width(expression->arguments[0]) : 1;
+			if( arguments(expression, 2, n) )
+			{
+				visit(expression->arguments[0], v);
+				visit(expression->arguments[1], v);
+				n > 1 ? v.il_vdot(n) : v.il_mul();
+			}
+			return;
+		}
+		else if( expression->functionName == L"cross" )
+		{
+			if( arguments(expression, 2, 3) )
+			{
+				visit(expression->arguments[0], v);
+				visit(expression->arguments[1], v);
+				v.il_vcross();
+			}
+			return;
+		}
+		else if( expression->functionName == L"noise1" || expression->functionName == L"noise2" || 
+				 expression->functionName == L"noise3" || expression->functionName == L"curl3" )
+		{
+			//Coordinates are given as scalars or vectors, like the 
+			//arguments of a constructor.
+			int n = expression->functionName == L"curl3" ? 3 : expression->functionName[5] - L'0', total = 0;
+			for( int i = 0; i < expression->arguments.size(); ++i ) {
+				total += width(expression->arguments[i]);
+			}
+
+			if( total != n )
+			{
+				error("%ls expects %d coordinates, got %d", expression->functionName.c_str(), n, total);
+				return;
+			}
+
+			for( int i = 0; i < expression->arguments.size(); ++i ) {
+				visit(expression->arguments[i], v);
+			}
+			expression->functionName == L"curl3" ? v.il_curl3() : v.il_noise(n);
+			return;
+		}
+		else if( expression->functionName == L"curve" )
+		{
+			//The first argument names the curve, the second is the time it
+			//is sampled at.
+			IdentExpr* id = expression->arguments.size() == 2 ? exp_cast<IdentExpr>(expression->arguments[0]) : 0;
+			std::map<std::string, std::pair<int, int> >::iterator it = id ? curves.find( std::string(id->value.begin(), id->value.end()) ) : curves.end();
+			if( it == curves.end() )
+			{
+				error("curve expects a declared curve and a time");
+			}
+			else if( width(expression->arguments[1]) != 1 )
+			{
+				error("curve expects a scalar time");
+			}
+			else
+			{
+				visit(expression->arguments[1], v);
+				v.il_curve(it->second.first);
+			}
+			return;
+		}
+		else if( expression->functionName == L"length" || expression->functionName == L"normalize" )
+		{
+			int n = expression->arguments.size() == 1 ? width(expression->arguments[0]) : 1;
+			if( arguments(expression, 1, n) )
+			{
+				visit(expression->arguments[0], v);
+				if( expression->functionName == L"length" )
+					n > 1 ? v.il_vlength(n) : v.il_abs();
+				else
+					n > 1 ? v.il_vnormalize(n) : v.il_sign();
+			}
+			return;
+		}
+
+		//Everything else is a scalar builtin or a native of the host.
+		int k = builtins().find( std::string(expression->functionName.begin(), expression->functionName.end()) );
+		if( k < 0 )
+		{
+			error("unknown function %ls", expression->functionName.c_str());
+		}
+		else if( arguments(expression, builtins()[k].arity, 1) )
+		{
+			pure = pure && builtins()[k].pure;
+			for( int i = 0; i < expression->arguments.size(); ++i ) {
+				visit(expression->arguments[i], v);
+			}
+			v.il_builtin(k);
+		}
+	}
+
+
+	void visit(Condition* expression, function& v, pass x)
+	{		
+		operatorStack.push(true);
+		visit(expression->booleanExpression, v);
+		operatorStack.pop();
+		assert(operatorStack.size() == 0 );
+
+		//Get the start of the method body
+		Label _start = v.il_get_label();
+		//Generate the body of the if-clause, what it writes is not written
+		//on every path and what it reads stays unread on the path around it.
+		std::set<Local> before = written;
+		std::set<Local> skipped = unread;
+		int waited = waits;
+		visit(expression->blockExpression, v);
+		written.swap(before);
+		unread.insert( skipped.begin(), skipped.end() );
+		if( waits != waited )
+		{
+			written.clear();
+		}
+		//Generate a jump instruction to jump back to the main body
+		Label _jmp = v.il_jmp( 0 );
+
+		//Obtain the end pointers (TODO: stack these? )
+		Label _end = v.il_get_label();	
+		v.il_set_label_instr(_jmp, _end);	
+
+		operatorStack.push(true);
+		trueStack.push(_start);
+		falseStack.push(_end);
+		visit(expression->booleanExpression, v, Post);
+		trueStack.pop();
+		falseStack.pop();
+		operatorStack.pop();
+		assert( trueStack.size() == 0 );
+		assert( falseStack.size() == 0 );
+		assert( operatorStack.size() == 0 );
+	}
+
+	void visit(ComparisonExp* expression, function& v, pass x)
+	{		
+		if( x == Normal )
+		{
+			if( width(expression->a) != 1 || width(expression->b) != 1 )
+			{
+				error("vectors can not be compared");
+			}
+
+			/*
+			case 1: printft(indent, "==\r\n"); break;
+			case 2: printft(indent, "!=\r\n"); break;									
+			*/
+
+			if( expression->op == 1 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_neq( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_eq( 0 );
+				}
+			}
+			else if( expression->op == 2 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_eq( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_neq( 0 );
+				}
+			}
+
+			/*
+			case 3: printft(indent, "<=\r\n"); break;
+			case 4: printft(indent, ">=\r\n"); break;
+			case 5: printft(indent, "<\r\n"); break;
+			case 6: printft(indent, ">\r\n"); break;
+			*/
+
+
+			else if( expression->op == 3 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_gt( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_elt( 0 );
+				}
+			}
+			else if( expression->op == 4 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_lt( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_egt( 0 );
+				}
+			}
+
+
+			else if( expression->op == 5 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_egt( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_lt( 0 );
+				}
+			}
+			else if( expression->op == 6 )
+			{
+				if( operatorStack.top() == true )
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_elt( 0 );
+				}
+				else
+				{
+					//First expression
+					visit(expression->a, v, x);
+					visit(expression->b, v, x);
+					jmp[expression] = v.il_gt( 0 );
+				}
+			}
+		
+
+
+		}
+		else
+		{
+			if( operatorStack.top() == true )
+			{
+				v.il_set_label_instr(jmp[expression], falseStack.top());
+			}
+			else
+			{
+				v.il_set_label_instr(jmp[expression], trueStack.top());
+			}
+		}
+	}
+
+
+	void visit(OrExpr* expression, function& v, pass x)
+	{		
+		if( x == Normal )
+		{
+			operatorStack.push(false);
+			labels_0[expression] = v.il_get_label();
+			visit(expression->a, v, x);
+			labels_1[expression] = v.il_get_label();
+			visit(expression->b, v, x);
+			labels_2[expression] = v.il_get_label();		
+			jmp[expression] = v.il_jmp(0);
+			operatorStack.pop();
+		}
+		else
+		{
+			//If expressions is true, return the flow to the parent true case, otherwise evaluate the second pair.
+			operatorStack.push(false);
+			trueStack.push( trueStack.top() ); falseStack.push( labels_1[expression] );
+			visit(expression->a, v, x);
+			trueStack.pop(); falseStack.pop();
+			operatorStack.pop();
+
+			//If expressions is true, return the flow to the parent true case, otherwise return flow to the parents false case.
+			operatorStack.push(false);
+			trueStack.push( trueStack.top() ); falseStack.push( falseStack.top() );
+			visit(expression->b, v, x);
+			trueStack.pop(); falseStack.pop();
+			operatorStack.pop();
+
+			//All the operations failed go back to the parents true case
+			v.il_set_label_instr(jmp[expression], falseStack.top() );
+		}
+	}
+
+
+	void visit(AndExpr* expression, function& v, pass x)
+	{		
+		if( x == Normal )
+		{
+			operatorStack.push(true);
+			labels_0[expression] = v.il_get_label();
+			visit(expression->a, v, x);
+			labels_1[expression] = v.il_get_label();
+			visit(expression->b, v, x);
+			labels_2[expression] = v.il_get_label();		
+			jmp[expression] = v.il_jmp(0);
+			operatorStack.pop();
+		}
+		else
+		{
+			//If expressions is true, return the flow to the parent true case, otherwise evaluate the second pair.
+			operatorStack.push(true);
+			trueStack.push( labels_1[expression] ); falseStack.push( falseStack.top() );
+			visit(expression->a, v, x);
+			trueStack.pop(); falseStack.pop();
+			operatorStack.pop();
+
+			//If expressions is true, return the flow to the parent true case, otherwise return flow to the parents false case.
+			operatorStack.push(true);
+			trueStack.push( trueStack.top() ); falseStack.push( falseStack.top() );
+			visit(expression->b, v, x);
+			trueStack.pop(); falseStack.pop();
+			operatorStack.pop();
+
+			//All the operations failed go back to the parents true case
+			v.il_set_label_instr(jmp[expression], trueStack.top() );
+		}
+	}	
+};
+
+// Parses source and compiles it into f, the syntax tree and the tables of 
+// the code generator live in a temporary context. Returns the number of 
+// errors. Nothing is shared between calls, so programs can be compiled on 
+// several threads at once as long as no natives are registered meanwhile.
+inline int compile(const char* source, int length, function& f)
+{
+	CompileContext context;
+	CompileScope scope(context);
+
+	Taste::Scanner scanner( reinterpret_cast<const unsigned char*>(source), length );
+	Taste::Parser parser(&scanner);
+	parser.Parse();
+	if( parser.errors->count != 0 )
+	{
+		return parser.errors->count;
+	}
+
+	visitor gen;
+	gen.visit(parser.results, f);
+	return gen.errors;
+}
+
+// Outcome of compiling one file with compile_files.
+struct compile_result
+{
+	std::string file;
+	int errors;
+	double seconds;
+};
+
+// Seconds on a monotonic wall clock.
+inline double wall_seconds()
+{
+	#if defined(_WIN32)
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart / (double)frequency.QuadPart;
+	#else
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+	#endif
+}
+
+// Nanoseconds on the clock of wall_seconds, deadlines of run_budget are
+// given on it.
+inline unsigned long long wall_nanoseconds()
+{
+	#if defined(_WIN32)
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	unsigned long long c = count.QuadPart, f = frequency.QuadPart;
+	return c / f * 1000000000ull + c % f * 1000000000ull / f;
+	#else
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+	#endif
+}
+
+inline unsigned int core_count()
+{
+	#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+	#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+	#endif
+}
+
+inline bool read_file(const std::string& name, std::string& text)
+{
+	FILE* file = fopen(name.c_str(), "rb");
+	if( file == 0 )
+	{
+		return false;
+	}
+
+	char buffer[4096];
+	size_t n = 0;
+	while( (n = fread(buffer, 1, sizeof(buffer), file)) > 0 ) {
+		text.append(buffer, n);
+	}
+
+	fclose(file);
+	return true;
+}
+
+// Work shared by the threads of compile_files, every thread takes the next
+// file until none are left.
+struct compile_job
+{
+	const std::vector<std::string>* files;
+	std::vector<function>* programs;
+	std::vector<compile_result>* results;
+	volatile long next;
+};
+
+inline long compile_next(volatile long* next)
+{
+	#if defined(_WIN32)
+	return InterlockedIncrement(next) - 1;
+	#else
+	return __sync_fetch_and_add(next, 1);
+	#endif
+}
+
+inline void compile_worker(compile_job* job)
+{
+	for( long i = compile_next(&job->next); i < (long)job->files->size(); i = compile_next(&job->next) ) {
+		compile_result& r = (*job->results)[i];
+		r.file = (*job->files)[i];
+		double start = wall_seconds();
+		std::string source;
+		if( read_file(r.file, source) )
+		{
+			r.errors = compile(source.c_str(), source.size(), (*job->programs)[i]);
+		}
+		else
+		{
+			printf("-- cannot read %s\n", r.file.c_str());
+			r.errors = 1;
+		}
+		r.seconds = wall_seconds() - start;
+	}
+}
+
+#if defined(_WIN32)
+inline DWORD WINAPI compile_thread(LPVOID job)
+{
+	compile_worker( static_cast<compile_job*>(job) );
+	return 0;
+}
+#else
+inline void* compile_thread(void* job)
+{
+	compile_worker( static_cast<compile_job*>(job) );
+	return 0;
+}
+#endif
+
+// Compiles every file into the program with the same index on up to threads
+// threads, 0 starts one per core. results receives the errors and the time
+// taken for every file. Returns the number of threads that were used.
+inline unsigned int compile_files(const std::vector<std::string>& files, std::vector<function>& programs, std::vector<compile_result>& results, unsigned int threads = 0)
+{
+	programs.assign( files.size(), function() );
+	results.assign( files.size(), compile_result() );
+
+	//The registry fills itself on first use, which must not race.
+	builtins();
+
+	threads = threads == 0 ? core_count() : threads;
+	threads = threads > files.size() ? files.size() : threads;
+	threads = threads == 0 ? 1 : threads;
+
+	compile_job job;
+	job.files = &files;
+	job.programs = &programs;
+	job.results = &results;
+	job.next = 0;
+
+	//The calling thread compiles as well.
+	#if defined(_WIN32)
+	std::vector<HANDLE> handles;
+	for( unsigned int i = 1; i < threads; ++i ) {
+		handles.push_back( CreateThread(0, 0, compile_thread, &job, 0, 0) );
+	}
+	compile_worker(&job);
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+	}
+	#else
+	std::vector<pthread_t> handles( threads - 1 );
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		pthread_create(&handles[i], 0, compile_thread, &job);
+	}
+	compile_worker(&job);
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		pthread_join(handles[i], 0);
+	}
+	#endif
+
+	return threads;
+}
+
+// Particles run_parallel hands to a thread at a time, a multiple of 
+// PEL_LANES so only the last chunk has a partial group.
+#define PEL_RUN_CHUNK 4096
+
+// Work of one thread of run_parallel. The threads share the program and the
+// counter next points to, every thread writes the unbound fields and the 
+// written bits to its own context.
+struct run_job
+{
+	function* program;
+	run_context context;
+	unsigned int count;
+	unsigned int entry;
+	volatile long* next;
+	long last;
+};
+
+inline void run_worker(run_job* job)
+{
+	long chunks = (job->count + PEL_RUN_CHUNK - 1) / PEL_RUN_CHUNK;
+	for( long i = compile_next(job->next); i < chunks; i = compile_next(job->next) ) {
+		unsigned int first = i * PEL_RUN_CHUNK;
+		unsigned int n = job->count - first < PEL_RUN_CHUNK ? job->count - first : PEL_RUN_CHUNK;
+		job->program->run_range( job->context, n, job->entry, first );
+		job->last = i;
+	}
+}
+
+#if defined(_WIN32)
+inline DWORD WINAPI run_thread(LPVOID job)
+{
+	run_worker( static_cast<run_job*>(job) );
+	return 0;
+}
+#else
+inline void* run_thread(void* job)
+{
+	run_worker( static_cast<run_job*>(job) );
+	return 0;
+}
+#endif
+
+// Runs an entry point over particles [0, count) on up to threads threads, 0 
+// starts one per core. A particle must not read what another one writes in 
+// the same run, fields that are read and written should be bound with 
+// bind_double and swapped afterwards. dirty receives the fields written by 
+// any thread and locals the values of the last particle, like run_batch.
+// Returns the number of threads that were used, 0 when entry waits and its 
+// state fields are not bound.
+inline unsigned int run_parallel(function& program, unsigned int count, unsigned int entry = 0, unsigned int threads = 0)
+{
+	unsigned int chunks = (count + PEL_RUN_CHUNK - 1) / PEL_RUN_CHUNK;
+	threads = threads == 0 ? core_count() : threads;
+	threads = threads > chunks ? chunks : threads;
+	if( threads <= 1 )
+	{
+		return program.run_batch( count, entry ) ? 1 : 0;
+	}
+
+	assert( program.resumable(entry) );
+	if( program.resumable(entry) == false )
+	{
+		return 0;
+	}
+
+	//The threads only read the program, each writes its own copy of the 
+	//unbound fields and its own written bits. Guards do not skip anything
+	//here.
+	program.run_prologue();
+	std::vector< std::vector<float> > locals( threads, program.locals );
+	std::vector< std::vector<unsigned int> > dirty( threads, std::vector<unsigned int>( program.dirty.size(), 0 ) );
+	std::vector<run_job> jobs( threads );
+	volatile long next = 0;
+	for( unsigned int i = 0; i < threads; ++i ) {
+		jobs[i].program = &program;
+		jobs[i].context.locals = &locals[i][0];
+		jobs[i].context.dirty = &dirty[i][0];
+		jobs[i].count = count;
+		jobs[i].entry = entry;
+		jobs[i].next = &next;
+		jobs[i].last = -1;
+	}
+
+	//The calling thread runs the first job.
+	#if defined(_WIN32)
+	std::vector<HANDLE> handles;
+	for( unsigned int i = 1; i < threads; ++i ) {
+		handles.push_back( CreateThread(0, 0, run_thread, &jobs[i], 0, 0) );
+	}
+	run_worker(&jobs[0]);
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+	}
+	#else
+	std::vector<pthread_t> handles( threads - 1 );
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		pthread_create(&handles[i], 0, run_thread, &jobs[i + 1]);
+	}
+	run_worker(&jobs[0]);
+	for( unsigned int i = 0; i < handles.size(); ++i ) {
+		pthread_join(handles[i], 0);
+	}
+	#endif
+
+	for( unsigned int i = 0; i < threads; ++i ) {
+		for( unsigned int w = 0; w < program.dirty.size(); ++w ) {
+			program.dirty[w] |= dirty[i][w];
+		}
+		if( jobs[i].last == (long)chunks - 1 )
+		{
+			program.locals.swap( locals[i] );
+		}
+	}
+
+	//No versions were bumped while the threads ran, every field that is 
+	//dirty counts as changed.
+	if( program.incremental )
+	{
+		for( unsigned int i = 0; i < program.locals.size(); ++i ) {
+			if( (i >> 5) < program.dirty.size() && (program.dirty[i >> 5] & (1u << (i & 31))) )
+			{
+				program.il_touch(i);
+			}
+		}
+	}
+
+	return threads;
+}
+
+// Particles run_budget runs between two looks at the clock, a multiple of
+// PEL_LANES.
+#define PEL_BUDGET_CHUNK 1024
+
+// Where run_budget stopped in a batch and how often the deadline cut one 
+// short.
+struct batch_cursor
+{
+	// First particle of the batch that has not run yet.
+	unsigned int next;
+	// Calls of run_budget, and the ones that returned with particles left.
+	unsigned int calls;
+	unsigned int overruns;
+	// Batches that finished and particles that ran.
+	unsigned int batches;
+	unsigned long long particles;
+
+	batch_cursor() : next(0), calls(0), overruns(0), batches(0), particles(0)
+	{
+	}
+};
+
+// What a call of run_budget did with the batch.
+enum budget_result
+{
+	// The deadline came first, the rest of the batch runs on a later call.
+	budget_partial,
+	// Every particle ran, the cursor starts the next batch at particle 0.
+	budget_done,
+	// Nothing ran, entry waits and its state fields are not bound.
+	budget_failed
+};
+
+// Runs an entry point over particles [cursor.next, count) PEL_BUDGET_CHUNK 
+// at a time until all of them ran or the next chunk would end past 
+// deadline on the clock of wall_nanoseconds, at least one chunk runs on 
+// every call. When the batch is not done the host calls it again on a 
+// later frame to continue, the prologue runs again then, so uniforms the 
+// host changed meanwhile apply to the rest of the batch. Double buffered 
+// fields should be swapped once the batch is done.
+inline budget_result run_budget(function& program, batch_cursor& cursor, unsigned int count, unsigned int entry, unsigned long long deadline)
+{
+	assert( program.resumable(entry) );
+	if( program.resumable(entry) == false )
+	{
+		return budget_failed;
+	}
+
+	cursor.calls++;
+	unsigned long long now = wall_nanoseconds();
+	while( cursor.next < count ) {
+		unsigned int n = count - cursor.next < PEL_BUDGET_CHUNK ? count - cursor.next : PEL_BUDGET_CHUNK;
+		program.run_batch( n, entry, cursor.next );
+		cursor.next += n;
+		cursor.particles += n;
+
+		//The next chunk is expected to take as long as this one.
+		unsigned long long done = wall_nanoseconds();
+		if( cursor.next < count && done + (done - now) > deadline )
+		{
+			cursor.overruns++;
+			return budget_partial;
+		}
+		now = done;
+	}
+
+	cursor.next = 0;
+	cursor.batches++;
+	return budget_done;
+}
+
+#endif //COMPILER_H
\ No newline at end of file
@@ -1,63 +1,216 @@
 #ifndef EXPRESSION_H
 #define EXPRESSION_H
 #include <vector>
-#include <stack>
+#include <map>
 #include <string>
+#include <algorithm>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 #include <math.h>
+#include "lanes.h"
+#include "noise.h"
+#include "builtins.h"
+#include "formats.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PEL_SSE
+#include <xmmintrin.h>
+#endif
+
+// Depth of the interpreter stack in floats, the stack is padded with four
+// extra floats so vector opcodes can always operate on four lanes.
+#define PEL_STACK_SIZE 256
+
+// Maximum nesting of calls to user defined functions, the compiler rejects
+// programs that nest them deeper.
+#define PEL_CALL_DEPTH 32
+
+// Number of samples curves are resampled to when they are baked.
+#define PEL_CURVE_SAMPLES 64
+
+// Packed operations on vec2/vec3/vec4 values. They always process four 
+// lanes, lanes past the width of the vector hold garbage that is ignored.
+inline void vec_add(float* a, const float* b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_add_ps( _mm_loadu_ps(a), _mm_loadu_ps(b) ) );
+	#else
+	a[0] += b[0]; a[1] += b[1]; a[2] += b[2]; a[3] += b[3];
+	#endif
+}
+
+inline void vec_sub(float* a, const float* b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_sub_ps( _mm_loadu_ps(a), _mm_loadu_ps(b) ) );
+	#else
+	a[0] -= b[0]; a[1] -= b[1]; a[2] -= b[2]; a[3] -= b[3];
+	#endif
+}
+
+inline void vec_mul(float* a, const float* b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_mul_ps( _mm_loadu_ps(a), _mm_loadu_ps(b) ) );
+	#else
+	a[0] *= b[0]; a[1] *= b[1]; a[2] *= b[2]; a[3] *= b[3];
+	#endif
+}
+
+inline void vec_div(float* a, const float* b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_div_ps( _mm_loadu_ps(a), _mm_loadu_ps(b) ) );
+	#else
+	a[0] /= b[0]; a[1] /= b[1]; a[2] /= b[2]; a[3] /= b[3];
+	#endif
+}
+
+inline void vec_scale(float* a, float b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_mul_ps( _mm_loadu_ps(a), _mm_set1_ps(b) ) );
+	#else
+	a[0] *= b; a[1] *= b; a[2] *= b; a[3] *= b;
+	#endif
+}
+
+inline void vec_splat(float* a, float b)
+{
+	#ifdef PEL_SSE
+	_mm_storeu_ps( a, _mm_set1_ps(b) );
+	#else
+	a[0] = b; a[1] = b; a[2] = b; a[3] = b;
+	#endif
+}
+
+inline float vec_dot(const float* a, const float* b, unsigned int n)
+{
+	float r = 0.0f;
+	for( unsigned int i = 0; i < n; ++i ) {
+		r += a[i] * b[i];
+	}
+	return r;
+}
 
-enum opcode
-{	
-	e_ret,
-	e_load,
-	e_store,
-	e_add,
-	e_sub,
-	e_mul,
-	e_div,
-	e_mod,
-
-	
-	e_jmp,
-	e_eq,
-	e_lt,
-	e_gt,
-	e_elt,
-	e_egt,
-	e_neq,
-	
-	e_lfld,
-	e_sfld,
-
-	e_tan,
-	e_sin,
-	e_cos,
-	e_tanh,
-	e_sinh,
-	e_cosh,
-	e_atan,
-	e_asin,
-	e_acos,
-
-	e_clamp,
-	e_lerp,
-	e_smoothstep,
-	e_sqrt,
-	e_abs,
-	e_sign,
-	e_radians,
-	e_degrees,
-	e_ceil,
-	e_floor,
-	e_round,
-	e_rand,
+// Samples a baked lookup table at t, see lanes_sample.
+inline void curve_sample(const float* lut, unsigned int count, unsigned int width, float start, float scale, float t, float* out)
+{
+	float x = (t - start) * scale;
+	x = x < 0.0f ? 0.0f : ( x > count - 1 ? count - 1 : x );
+	unsigned int i = (unsigned int)x;
+	i = i > count - 2 ? count - 2 : i;
+	float f = x - i;
+	const float* a = lut + i * width;
+	for( unsigned int c = 0; c < width; ++c ) {
+		out[c] = a[c] + (a[c + width] - a[c]) * f;
+	}
+}
+
+// What a field holds between runs, the compiler works it out for every 
+// field of a program.
+enum field_usage
+{
+	// One value per particle that has to be kept between runs, the field is
+	// read before it is written, a run leaves it written for the host or
+	// the script exports it.
+	usage_persistent,
+	// One value for all particles, set by the host or by the prologue.
+	usage_uniform,
+	// Written before it is read and read again after every write by every
+	// entry point, the value only lives for the duration of one run and 
+	// needs no storage of its own.
+	usage_temporary,
 };
 
 class function;
 typedef unsigned int Label;
 typedef unsigned int Local;
 
+// Host storage a field is bound to. Particle n reads and writes the value at
+// base + n * stride, so an array of structs binds with stride sizeof(struct)
+// and a column of floats with stride sizeof(float). A null base means the
+// field lives in function::locals. Double buffered fields keep the previous
+// frame at base, runs copy a particle to next and update it there.
+struct binding
+{
+	char*		 base;
+	char*		 next;
+	unsigned int stride;
+	field_format format;
+
+	binding() : base(0), next(0), stride(0), format(format_float)
+	{
+	}
+
+	// The buffer runs read and write.
+	char* current() const
+	{
+		return next ? next : base;
+	}
+};
+
+// A curve or gradient baked into a lookup table of PEL_CURVE_SAMPLES samples
+// of width floats each, stored at offset in function::tables. The samples
+// are spread uniformly over the time of the first to the last key.
+struct curve
+{
+	std::string  name;
+	unsigned int offset;
+	unsigned int width;
+	float		 start;
+	float		 scale;
+};
+
+// What a run writes besides the bound fields: the values of the unbound
+// fields, the bits of the fields it wrote and the guarded statements it
+// skips. The function keeps its own, threads that run the same function at
+// once each bring one, see function::run_range.
+struct run_context
+{
+	float* locals;
+	unsigned int* dirty;
+	const char* skips;
+	unsigned int guards;
+
+	run_context() : locals(0), dirty(0), skips(0), guards(0)
+	{
+	}
+};
+
+// A top level statement of an entry point compiled with function::incremental
+// set. Its e_guard skips it in run_batch while nothing it reads changed since
+// it last ran over the same particles.
+struct statement_guard
+{
+	unsigned int entry;
+	std::vector<Local> reads;
+	std::vector<Local> writes;
+	// Set by the compiler when skipping is safe: the statement has no side 
+	// effects, calls no function, reads no temporaries and no other code 
+	// writes its fields.
+	bool skippable;
+	// When it last ran, the versions of what it read followed by those of
+	// what it wrote, and the particles it ran over.
+	bool ran;
+	std::vector<unsigned int> seen;
+	unsigned int first;
+	unsigned int count;
+
+	statement_guard() : entry(0), skippable(false), ran(false), first(0), count(0)
+	{
+	}
+};
+
+// Stack slots a called function takes at most, how deep the calls it makes
+// nest and the width of the value it returns, see function::il_depth.
+struct function_depth
+{
+	unsigned int stack;
+	unsigned int nested;
+	unsigned int width;
+};
 
 class function
 {
@@ -65,7 +218,50 @@ class function
 public:
 	std::vector<float> locals;
 	std::vector<std::string> localNames;
+	std::vector<binding> bindings;
+	// Declared storage formats of the fields, see il_format.
+	std::vector<field_format> formats;
+	// Usage of the fields, see il_usage.
+	std::vector<field_usage> usages;
+	// Bit i of word i / 32 is set once an executed e_sfld or e_vsfld wrote
+	// field i, stores of every run and run_batch accumulate until the host
+	// calls clear_dirty.
+	std::vector<unsigned int> dirty;
+	std::vector<curve> curves;
+	std::vector<float> tables;
+	// Literals of the module, every distinct value is stored once and 
+	// loaded by its index.
+	std::vector<float> constants;
+	// Entry points of the module and where their code starts, the code in
+	// front of the first entry point is the prologue.
+	std::vector<std::string> entryNames;
+	std::vector<Label> entries;
+	// Field that holds where a particle continues every entry point that
+	// waits, -1 for the others. The time it wakes up is in the next field.
+	std::vector<int> states;
+	// Clock of wait in seconds, the host advances it between runs.
+	float time;
+	// Seed of the noise builtins, run and run_batch give the same noise for
+	// the same seed.
+	unsigned int seed;
+	// Literals that are exact in half precision and not yet in the constant
+	// pool are stored in the bytecode as a two byte half instead. This keeps
+	// small programs small, programs that load the same literal many times
+	// are better served by the pool.
+	bool half_constants;
+	// Compiles the top level statements of the entry points with guards, set
+	// before compiling. run_batch then skips the statements whose inputs did
+	// not change, the host calls touch when it changes bound fields.
+	bool incremental;
+	std::vector<statement_guard> guards;
+	// Version of every field, bumped whenever it may have changed.
+	std::vector<unsigned int> versions;
 private:
+	// Guards run_batch skips, and the values of the unbound fields and the 
+	// seed incremental runs last saw.
+	std::vector<char> skips;
+	std::vector<float> watched;
+	unsigned int watchedSeed;
 
 
 
@@ -93,6 +289,49 @@ private:
 		bytecode.push_back( (v & 0xFF000000) >> 24 );
 	}
 
+	void il_add_bytecode_u16( unsigned int v )
+	{
+		bytecode.push_back( (v & 0x000000FF) >> 0 );
+		bytecode.push_back( (v & 0x0000FF00) >> 8 );
+	}
+
+	unsigned int il_decode_u16( char* v )
+	{
+		return (unsigned char)v[0] | ((unsigned char)v[1] << 8);
+	}
+
+	// Variable length operand, seven bits per byte starting with the lowest
+	// and the top bit set on every byte but the last. Slots below 128 take
+	// one byte and slots below 16384 two.
+	void il_add_bytecode_var( unsigned int v )
+	{
+		while( v >= 0x80 ) {
+			bytecode.push_back( (char)(0x80 | (v & 0x7F)) );
+			v >>= 7;
+		}
+		bytecode.push_back( (char)v );
+	}
+
+	// Decodes a variable length operand and moves v past it.
+	unsigned int il_decode_var( char*& v )
+	{
+		unsigned int r = (unsigned char)*(v++);
+		if( r < 0x80 )
+		{
+			return r;
+		}
+
+		r &= 0x7F;
+		for( unsigned int shift = 7; ; shift += 7 ) {
+			unsigned int b = (unsigned char)*(v++);
+			r |= (b & 0x7F) << shift;
+			if( b < 0x80 )
+			{
+				return r;
+			}
+		}
+	}
+
 	unsigned int il_decode_u32( char* v )
 	{
 		return *reinterpret_cast<unsigned int*>( v );
@@ -105,10 +344,219 @@ private:
 		return *reinterpret_cast<float*>( v );
 	}
 
+	// Skips the instruction at v and its operands.
+	char* il_next( char* v )
+	{
+		switch( *v++ )
+		{
+			case e_load:
+			case e_jmp:
+			case e_eq:
+			case e_neq:
+			case e_lt:
+			case e_gt:
+			case e_elt:
+			case e_egt:
+				return v + 4;
+			case e_call:
+				return v + 5;
+			case e_guard:
+				v += 4;
+				il_decode_var(v);
+				return v;
+			case e_lfld:
+			case e_sfld:
+			case e_curve:
+			case e_native:
+			case e_wait:
+				il_decode_var(v);
+				return v;
+			case e_vlfld:
+			case e_vsfld:
+				++v;
+				il_decode_var(v);
+				return v;
+			case e_vswizzle:
+				return v + 3;
+			case e_larg:
+			case e_sarg:
+			case e_loadk16:
+			case e_loadh:
+				return v + 2;
+			case e_vsplat:
+			case e_vadd:
+			case e_vsub:
+			case e_vmul:
+			case e_vdiv:
+			case e_vmod:
+			case e_vdot:
+			case e_vlength:
+			case e_vnormalize:
+			case e_enter:
+			case e_retv:
+			case e_loadk8:
+				return v + 1;
+			default:
+				return v;
+		}
+	}
+
+	static bool il_branch( char op )
+	{
+		return op == e_eq || op == e_neq || op == e_lt || op == e_gt || op == e_elt || op == e_egt;
+	}
+
+	// The branch taken exactly when op is not, NaNs aside.
+	static char il_inverse( char op )
+	{
+		switch( op )
+		{
+			case e_eq:  return e_neq;
+			case e_neq: return e_eq;
+			case e_lt:  return e_egt;
+			case e_egt: return e_lt;
+			case e_gt:  return e_elt;
+			default:    return e_gt;
+		}
+	}
+
+	float il_load( const run_context& ctx, unsigned int i, unsigned int index )
+	{
+		if( i < bindings.size() && bindings[i].base != 0 )
+		{
+			const binding& b = bindings[i];
+			return format_load( b.current() + index * b.stride, b.format );
+		}
+
+		return ctx.locals[i];
+	}
+
+	static void il_mark( const run_context& ctx, unsigned int i )
+	{
+		ctx.dirty[i >> 5] |= 1u << (i & 31);
+	}
+
+	void il_track()
+	{
+		if( dirty.size() * 32 < locals.size() )
+		{
+			dirty.resize( (locals.size() + 31) / 32, 0 );
+		}
+	}
+
+	void il_store( const run_context& ctx, unsigned int i, unsigned int index, float a )
+	{
+		il_mark(ctx, i);
+		if( i < bindings.size() && bindings[i].base != 0 )
+		{
+			const binding& b = bindings[i];
+			format_store( b.current() + index * b.stride, b.format, a );
+			return;
+		}
+
+		ctx.locals[i] = a;
+	}
+
+	bool il_bound( unsigned int i )
+	{
+		return i < bindings.size() && bindings[i].base != 0;
+	}
+
+	// Replaces the arguments of builtin b on top of sp by its result for
+	// every lane, n lanes are alive. Builtins that are not pure run once
+	// for every live lane and no more.
+	static void run_builtin( const builtin& b, lanes*& sp, unsigned int n )
+	{
+		sp -= b.arity;
+		if( b.simd && (b.pure || n == PEL_LANES) )
+		{
+			lanes r;
+			b.simd( sp, r );
+			*sp = r;
+		}
+		else
+		{
+			for( unsigned int l = 0; l < (b.pure ? PEL_LANES : n); ++l ) {
+				float a[PEL_BUILTIN_ARGS];
+				for( unsigned int k = 0; k < b.arity; ++k ) {
+					a[k] = sp[k].v[l];
+				}
+				sp[0].v[l] = b.scalar(a);
+			}
+		}
+		sp++;
+	}
+
+	// Loads field i of particles [first, first + n) into a, lanes past n 
+	// repeat the first particle. Unbound fields come from regs.
+	void load_lanes( lanes& a, unsigned int i, unsigned int first, unsigned int n, lanes* regs )
+	{
+		if( il_bound(i) == false )
+		{
+			a = regs[i];
+			return;
+		}
+
+		const binding& b = bindings[i];
+		char* p = b.current() + first * b.stride;
+		if( b.stride == format_size(b.format) && n == PEL_LANES )
+		{
+			lanes_unpack( a, p, b.format );
+			return;
+		}
+
+		for( unsigned int l = 0; l < n; ++l ) {
+			a.v[l] = format_load( p + l * b.stride, b.format );
+		}
+		for( unsigned int l = n; l < PEL_LANES; ++l ) {
+			a.v[l] = a.v[0];
+		}
+	}
+
+	void store_lanes( const run_context& ctx, const lanes& a, unsigned int i, unsigned int first, unsigned int n, lanes* regs )
+	{
+		il_mark(ctx, i);
+		if( il_bound(i) == false )
+		{
+			regs[i] = a;
+			return;
+		}
+
+		const binding& b = bindings[i];
+		char* p = b.current() + first * b.stride;
+		if( b.stride == format_size(b.format) && n == PEL_LANES )
+		{
+			lanes_pack( a, p, b.format );
+			return;
+		}
+
+		for( unsigned int l = 0; l < n; ++l ) {
+			format_store( p + l * b.stride, b.format, a.v[l] );
+		}
+	}
+
+
+	// Copies particles [first, first + n) of a double buffered field from 
+	// the previous frame into the next one, so values a run does not write
+	// carry over.
+	void carry( unsigned int i, unsigned int first, unsigned int n )
+	{
+		const binding& b = bindings[i];
+		unsigned int size = format_size(b.format);
+		if( b.stride == size )
+		{
+			memcpy( b.next + first * size, b.base + first * size, n * size );
+			return;
+		}
+
+		for( unsigned int l = first; l < first + n; ++l ) {
+			memcpy( b.next + l * b.stride, b.base + l * b.stride, size );
+		}
+	}
 
 public:
 
-	function()
+	function() : time(0.0f), seed(0), half_constants(false), incremental(false), watchedSeed(0)
 	{
 		locals.push_back(0.0f);
 		localNames.push_back("position.x");
@@ -120,239 +568,1786 @@ public:
 		return bytecode.size();
 	}
 
-	Label il_get_label()
+	bool il_find_local(const std::string& name, Local& slot)
 	{
-		return bytecode.size();
-	}
-
+		for( unsigned int i = 0; i < localNames.size(); ++i ) {
+			if( localNames[i].compare(name) == 0 )
+			{
+				slot = i;
+				return true;
+			}
+		}
 
+		return false;
+	}
 
-	void il_set_label_instr(Label lbl, Label rwr)
+	Local il_local(const std::string& name)
 	{
-		bytecode[lbl + 0] = (rwr & 0x000000FF) >> 0;
-		bytecode[lbl + 1] = (rwr & 0x0000FF00) >> 8;
-		bytecode[lbl + 2] = (rwr & 0x00FF0000) >> 16;
-		bytecode[lbl + 3] = (rwr & 0xFF000000) >> 24;
+		Local slot = 0;
+		if( il_find_local(name, slot) == false )
+		{
+			slot = localNames.size();
+			localNames.push_back(name);
+			locals.push_back(0.0f);
+		}
+
+		return slot;
 	}
 
-	Label il_eq(Label lbl)
+	// Forgets a field, the slots of the fields after it move down by one so 
+	// this is only valid while no code refers to fields.
+	void il_remove_local(const std::string& name)
 	{
-		il_add_bytecode_u8( e_eq );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		Local slot = 0;
+		if( il_find_local(name, slot) )
+		{
+			assert( bytecode.empty() );
+			localNames.erase( localNames.begin() + slot );
+			locals.erase( locals.begin() + slot );
+			if( slot < formats.size() )
+			{
+				formats.erase( formats.begin() + slot );
+			}
+			if( slot < usages.size() )
+			{
+				usages.erase( usages.begin() + slot );
+			}
+		}
 	}
 
-	Label il_neq(Label lbl)
+	// Declares how a field is stored when the host binds it without giving
+	// a format, fields that were never declared with one are floats.
+	void il_format(Local slot, field_format format)
 	{
-		il_add_bytecode_u8( e_neq );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		if( formats.size() < locals.size() )
+		{
+			formats.resize( locals.size(), format_float );
+		}
+
+		formats[slot] = format;
 	}
 
-	Label il_gt(Label lbl)
+	// The declared format of a field, hosts use it to lay out the storage
+	// they bind.
+	field_format format(const std::string& name)
 	{
-		il_add_bytecode_u8( e_gt );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		Local slot = 0;
+		if( il_find_local(name, slot) && slot < formats.size() )
+		{
+			return formats[slot];
+		}
+
+		return format_float;
 	}
 
-	Label il_lt(Label lbl)
+	// Records what a field holds between runs, fields the compiler did not
+	// classify are persistent.
+	void il_usage(Local slot, field_usage usage)
 	{
-		il_add_bytecode_u8( e_lt );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		if( usages.size() < locals.size() )
+		{
+			usages.resize( locals.size(), usage_persistent );
+		}
+
+		usages[slot] = usage;
 	}
 
-	Label il_egt(Label lbl)
+	field_usage usage(const std::string& name)
 	{
-		il_add_bytecode_u8( e_egt );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		Local slot = 0;
+		if( il_find_local(name, slot) && slot < usages.size() )
+		{
+			return usages[slot];
+		}
+
+		return usage_persistent;
 	}
 
-	Label il_elt(Label lbl)
+	// Whether a field was written since the last clear_dirty, hosts only
+	// upload the columns that were.
+	bool is_dirty(const std::string& name)
 	{
-		il_add_bytecode_u8( e_elt );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		Local slot = 0;
+		return il_find_local(name, slot) && (slot >> 5) < dirty.size() && (dirty[slot >> 5] & (1u << (slot & 31))) != 0;
 	}
 
-	Label il_jmp(Label lbl)
+	void clear_dirty()
 	{
-		il_add_bytecode_u8( e_jmp );
-		Label l = il_get_label();
-		il_add_bytecode_u32( lbl );
-		return l;
+		dirty.assign( dirty.size(), 0 );
 	}
 
-	void il_add()
+	bool il_temporary( unsigned int i )
 	{
-		il_add_bytecode_u8(e_add);
+		return i < usages.size() && usages[i] == usage_temporary;
 	}
 
-	void il_sub()
+	// Maps a field onto host memory, see binding. The values are stored in
+	// the format the field was declared with. Returns false when the program
+	// has no field with that name.
+	bool bind(const std::string& name, void* base, unsigned int stride)
 	{
-		il_add_bytecode_u8(e_sub);
+		return bind( name, base, stride, format(name) );
 	}
 
-	void il_mul()
+	bool bind(const std::string& name, void* base, unsigned int stride, field_format format)
 	{
-		il_add_bytecode_u8(e_mul);
+		Local slot = 0;
+		if( il_find_local(name, slot) == false )
+		{
+			return false;
+		}
+
+		if( bindings.size() < locals.size() )
+		{
+			bindings.resize( locals.size() );
+		}
+
+		bindings[slot].base = reinterpret_cast<char*>(base);
+		bindings[slot].next = 0;
+		bindings[slot].stride = stride;
+		bindings[slot].format = format;
+		il_touch(slot);
+		return true;
 	}
 
-	void il_div()
+	// Tells incremental runs that the host changed a field, or every 
+	// component of a vector.
+	void touch(const std::string& name)
 	{
-		il_add_bytecode_u8(e_div);
+		for( unsigned int i = 0; i < localNames.size(); ++i ) {
+			if( localNames[i] == name || localNames[i].compare(0, name.size() + 1, name + ".") == 0 )
+			{
+				il_touch(i);
+			}
+		}
 	}
 
-	void il_mod()
+	void il_touch(unsigned int i)
 	{
-		il_add_bytecode_u8(e_mod);
+		if( versions.size() < locals.size() )
+		{
+			versions.resize( locals.size(), 0 );
+		}
+		versions[i]++;
 	}
 
-	void il_push(float v)
+	// Binds a field to two buffers of the same layout. A run copies its 
+	// particles from the frame in front to the one in back and updates them
+	// there, the front keeps the previous frame for whoever reads it while
+	// the particles are updated. swap_buffers flips them once every particle
+	// has run.
+	bool bind_double(const std::string& name, void* front, void* back, unsigned int stride)
 	{
-		il_add_bytecode_u8( e_load );
-		il_add_bytecode_flt( v );
+		return bind_double( name, front, back, stride, format(name) );
 	}
 
-	void il_sin()
+	bool bind_double(const std::string& name, void* front, void* back, unsigned int stride, field_format format)
 	{
-		il_add_bytecode_u8( e_sin );
+		if( bind(name, front, stride, format) == false )
+		{
+			return false;
+		}
+
+		Local slot = 0;
+		il_find_local(name, slot);
+		bindings[slot].next = reinterpret_cast<char*>(back);
+		return true;
 	}
 
-	void il_cos()
+	// Makes the frame the last runs wrote the one the next runs read.
+	void swap_buffers()
 	{
-		il_add_bytecode_u8( e_cos );
+		for( unsigned int i = 0; i < bindings.size(); ++i ) {
+			if( bindings[i].next != 0 )
+			{
+				std::swap( bindings[i].base, bindings[i].next );
+			}
+		}
 	}
 
-	void il_tan()
+	bool bind_column(const std::string& name, float* column)
 	{
-		il_add_bytecode_u8( e_tan );
+		return bind( name, column, sizeof(float), format_float );
 	}
 
-	void il_sinh()
+	void unbind(const std::string& name)
 	{
-		il_add_bytecode_u8( e_sinh );
+		Local slot = 0;
+		if( il_find_local(name, slot) && slot < bindings.size() )
+		{
+			bindings[slot] = binding();
+		}
 	}
 
-	void il_cosh()
+	void unbind_all()
 	{
-		il_add_bytecode_u8( e_cosh );
+		bindings.clear();
 	}
 
-	void il_tanh()
+	bool il_find_curve(const std::string& name, unsigned int& index)
 	{
-		il_add_bytecode_u8( e_tanh );
+		for( unsigned int i = 0; i < curves.size(); ++i ) {
+			if( curves[i].name.compare(name) == 0 )
+			{
+				index = i;
+				return true;
+			}
+		}
+
+		return false;
 	}
 
-	void il_asin()
+	// Bakes count keys into the lookup table of a curve, each key is a time
+	// followed by width floats and the times must be ascending. Baking a 
+	// curve that already exists replaces its table, which lets the host 
+	// tweak curves of a compiled program. Returns the index of the curve or
+	// -1 when the keys are invalid or the width does not match.
+	int bake_curve(const std::string& name, const float* keys, unsigned int count, unsigned int width)
 	{
-		il_add_bytecode_u8( e_asin );
-	}
+		if( count == 0 || width == 0 )
+		{
+			return -1;
+		}
+
+		unsigned int stride = width + 1;
+		for( unsigned int k = 1; k < count; ++k ) {
+			if( keys[k * stride] < keys[(k - 1) * stride] )
+			{
+				return -1;
+			}
+		}
+
+		unsigned int index = 0;
+		if( il_find_curve(name, index) )
+		{
+			if( curves[index].width != width )
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			curve c;
+			c.name = name;
+			c.offset = tables.size();
+			c.width = width;
+			index = curves.size();
+			curves.push_back( c );
+			tables.resize( tables.size() + PEL_CURVE_SAMPLES * width );
+		}
+
+		curve& c = curves[index];
+		float first = keys[0];
+		float last = keys[(count - 1) * stride];
+		c.start = first;
+		c.scale = last > first ? (PEL_CURVE_SAMPLES - 1) / (last - first) : 0.0f;
+
+		unsigned int k = 0;
+		for( unsigned int s = 0; s < PEL_CURVE_SAMPLES; ++s ) {
+			float t = first + (last - first) * s / (PEL_CURVE_SAMPLES - 1);
+			while( k + 1 < count && keys[(k + 1) * stride] <= t ) {
+				++k;
+			}
+
+			const float* a = keys + k * stride;
+			float* out = &tables[c.offset + s * width];
+			if( k + 1 >= count || keys[(k + 1) * stride] <= a[0] )
+			{
+				for( unsigned int i = 0; i < width; ++i ) {
+					out[i] = a[1 + i];
+				}
+			}
+			else
+			{
+				const float* b = a + stride;
+				float f = (t - a[0]) / (b[0] - a[0]);
+				for( unsigned int i = 0; i < width; ++i ) {
+					out[i] = a[1 + i] + (b[1 + i] - a[1 + i]) * f;
+				}
+			}
+		}
+
+		return index;
+	}
+
+	Label il_get_label()
+	{
+		return bytecode.size();
+	}
+
+	// Starts the code of an entry point. Code emitted before the first entry
+	// point is the prologue, which computes values that are the same for 
+	// every particle and ends with il_ret.
+	void il_entry(const std::string& name)
+	{
+		entryNames.push_back(name);
+		entries.push_back(il_get_label());
+		states.push_back(-1);
+	}
+
+	// Makes the current entry point resumable, slot and slot + 1 are the
+	// fields of its state, see il_wait.
+	void il_state(Local slot)
+	{
+		states.back() = slot;
+	}
+
+	// Index of an entry point for run and run_batch, or -1 when the program
+	// has no entry point with that name.
+	int entry_point(const std::string& name)
+	{
+		for( unsigned int i = 0; i < entryNames.size(); ++i ) {
+			if( entryNames[i].compare(name) == 0 )
+			{
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+
+
+	void il_set_label_instr(Label lbl, Label rwr)
+	{
+		bytecode[lbl + 0] = (rwr & 0x000000FF) >> 0;
+		bytecode[lbl + 1] = (rwr & 0x0000FF00) >> 8;
+		bytecode[lbl + 2] = (rwr & 0x00FF0000) >> 16;
+		bytecode[lbl + 3] = (rwr & 0xFF000000) >> 24;
+	}
+
+	Label il_eq(Label lbl)
+	{
+		il_add_bytecode_u8( e_eq );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	Label il_neq(Label lbl)
+	{
+		il_add_bytecode_u8( e_neq );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	Label il_gt(Label lbl)
+	{
+		il_add_bytecode_u8( e_gt );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	Label il_lt(Label lbl)
+	{
+		il_add_bytecode_u8( e_lt );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	Label il_egt(Label lbl)
+	{
+		il_add_bytecode_u8( e_egt );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	Label il_elt(Label lbl)
+	{
+		il_add_bytecode_u8( e_elt );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	// Cleans up the branches of a finished program. Jumps to jumps are 
+	// retargeted to the final target and jumps to e_ret become e_ret. A branch
+	// over a jump turns into the inverse branch to the target of the jump,
+	// jumps to the next instruction and code that cannot be reached are 
+	// removed. Call targets and entry points are moved along.
+	void il_thread()
+	{
+		//Instruction i starts at at[i], at[n] is the end of the bytecode.
+		std::vector<unsigned int> at;
+		std::vector<int> index( bytecode.size() + 1, -1 );
+		for( unsigned int pc = 0; pc < bytecode.size(); pc = il_next(&bytecode[pc]) - &bytecode[0] ) {
+			index[pc] = at.size();
+			at.push_back(pc);
+		}
+		unsigned int n = at.size();
+		index[bytecode.size()] = n;
+		at.push_back( bytecode.size() );
+
+		std::vector<char> ops( n + 1, e_ret );
+		std::vector<int> targets( n + 1, -1 );
+		for( unsigned int i = 0; i < n; ++i ) {
+			ops[i] = bytecode[at[i]];
+			if( ops[i] == e_jmp || ops[i] == e_call || ops[i] == e_guard || il_branch(ops[i]) )
+			{
+				targets[i] = index[ il_decode_u32(&bytecode[at[i] + 1]) ];
+			}
+		}
+
+		std::vector<bool> live( n + 1, true );
+		for( bool changed = true; changed; ) {
+			changed = false;
+
+			for( unsigned int i = 0; i < n; ++i ) {
+				if( live[i] == false || targets[i] < 0 || ops[i] == e_call )
+				{
+					continue;
+				}
+
+				//The live instruction a branch lands on.
+				int t = targets[i];
+				for( unsigned int hops = 0; hops <= n; ++hops ) {
+					while( live[t] == false ) ++t;
+					if( ops[t] != e_jmp || targets[t] == t )
+					{
+						break;
+					}
+					t = targets[t];
+				}
+
+				if( ops[i] == e_jmp && ops[t] == e_ret && t != (int)n )
+				{
+					ops[i] = e_ret;
+					targets[i] = -1;
+					changed = true;
+				}
+				else if( t != targets[i] )
+				{
+					targets[i] = t;
+					changed = true;
+				}
+			}
+
+			std::vector<unsigned int> landings( n + 1, 0 );
+			for( unsigned int i = 0; i < n; ++i ) {
+				if( live[i] && targets[i] >= 0 )
+				{
+					landings[targets[i]]++;
+				}
+			}
+
+			for( unsigned int i = 0; i < n; ++i ) {
+				if( live[i] == false )
+				{
+					continue;
+				}
+
+				unsigned int next = i + 1;
+				while( live[next] == false ) ++next;
+				unsigned int after = next + 1;
+				while( after < n && live[after] == false ) ++after;
+				int t = targets[i];
+				while( t >= 0 && live[t] == false ) ++t;
+
+				//What lands on a removed jump lands on the next instruction.
+				if( ops[i] == e_jmp && t == (int)next )
+				{
+					landings[next] += landings[i] - 1;
+					landings[i] = 0;
+					live[i] = false;
+					changed = true;
+				}
+				else if( il_branch(ops[i]) && next < n && ops[next] == e_jmp && landings[next] == 0 && t == (int)after )
+				{
+					landings[after]--;
+					ops[i] = il_inverse(ops[i]);
+					targets[i] = targets[next];
+					live[next] = false;
+					changed = true;
+				}
+			}
+
+			//Whatever neither falls through from live code nor is jumped to 
+			//from it is gone.
+			std::vector<bool> reached( n + 1, false );
+			std::vector<unsigned int> work;
+			work.push_back(0);
+			for( unsigned int e = 0; e < entries.size(); ++e ) {
+				work.push_back( index[entries[e]] );
+			}
+			while( work.empty() == false ) {
+				unsigned int i = work.back();
+				work.pop_back();
+				while( i < n && live[i] == false ) ++i;
+				if( i >= n || reached[i] )
+				{
+					continue;
+				}
+
+				reached[i] = true;
+				if( targets[i] >= 0 )
+				{
+					work.push_back( targets[i] );
+				}
+				if( ops[i] != e_jmp && ops[i] != e_ret && ops[i] != e_retv )
+				{
+					work.push_back( i + 1 );
+				}
+			}
+
+			for( unsigned int i = 0; i < n; ++i ) {
+				if( live[i] && reached[i] == false )
+				{
+					live[i] = false;
+					changed = true;
+				}
+			}
+		}
+
+		//Removed instructions are replaced by the next live one.
+		std::vector<unsigned int> moved( n + 1 );
+		std::vector<char> code;
+		for( unsigned int i = 0; i < n; ++i ) {
+			moved[i] = code.size();
+			if( live[i] == false )
+			{
+				continue;
+			}
+
+			code.push_back( ops[i] );
+			if( ops[i] != e_ret )
+			{
+				code.insert( code.end(), bytecode.begin() + at[i] + 1, bytecode.begin() + at[i + 1] );
+			}
+		}
+		moved[n] = code.size();
+
+		for( unsigned int i = 0; i < n; ++i ) {
+			if( live[i] && targets[i] >= 0 )
+			{
+				unsigned int to = moved[ targets[i] ];
+				memcpy( &code[moved[i] + 1], &to, sizeof(to) );
+			}
+		}
+
+		for( unsigned int e = 0; e < entries.size(); ++e ) {
+			entries[e] = moved[ index[entries[e]] ];
+		}
+		bytecode.swap(code);
+	}
+
+	// Where the functions that are called start, the prologue and the entry
+	// points come before it.
+	Label il_functions()
+	{
+		Label end = bytecode.size();
+		for( unsigned int pc = 0; pc < bytecode.size(); pc = il_next(&bytecode[pc]) - &bytecode[0] ) {
+			if( bytecode[pc] == e_call && il_decode_u32(&bytecode[pc + 1]) < end )
+			{
+				end = il_decode_u32(&bytecode[pc + 1]);
+			}
+		}
+		return end;
+	}
+
+	// Stack slots the code in [start, end) takes at most when its frame
+	// starts out with base of them, including the functions it calls, and
+	// how deep those calls nest. The code of a function ends at its e_retv,
+	// returns the width of the value it returns there. Every statement
+	// leaves the stack as it found it, so the code is followed in order and
+	// branches need not be.
+	// The functions already followed are kept in known.
+	unsigned int il_depth(Label start, Label end, unsigned int base, unsigned int& stack, unsigned int& nested, std::map<Label, function_depth>& known)
+	{
+		int depth = base;
+		stack = base;
+		nested = 0;
+		for( char* v = &bytecode[0] + start; v < &bytecode[0] + end; v = il_next(v) ) {
+			char* o = v + 1;
+			switch( *v )
+			{
+				case e_load:
+				case e_loadk8:
+				case e_loadk16:
+				case e_loadh:
+				case e_lfld:
+					depth++;
+					break;
+				case e_store:
+				case e_add:
+				case e_sub:
+				case e_mul:
+				case e_div:
+				case e_mod:
+				case e_sfld:
+				case e_wait:
+					depth--;
+					break;
+				case e_eq:
+				case e_neq:
+				case e_lt:
+				case e_gt:
+				case e_elt:
+				case e_egt:
+					depth -= 2;
+					break;
+				case e_tan:
+				case e_sin:
+				case e_cos:
+				case e_tanh:
+				case e_sinh:
+				case e_cosh:
+				case e_atan:
+				case e_asin:
+				case e_acos:
+				case e_clamp:
+				case e_lerp:
+				case e_smoothstep:
+				case e_sqrt:
+				case e_abs:
+				case e_sign:
+				case e_radians:
+				case e_degrees:
+				case e_ceil:
+				case e_floor:
+				case e_round:
+				case e_rand:
+					depth += 1 - builtins().instruction(*v).arity;
+					break;
+				case e_native:
+					depth += 1 - builtins()[il_decode_var(o)].arity;
+					break;
+				case e_noise1:
+				case e_noise2:
+				case e_noise3:
+					depth -= *v - e_noise1;
+					break;
+				case e_curve:
+					depth += curves[il_decode_var(o)].width - 1;
+					break;
+				case e_vlfld:
+				case e_enter:
+					depth += (unsigned char)o[0];
+					break;
+				case e_vsfld:
+				case e_vadd:
+				case e_vsub:
+				case e_vmul:
+				case e_vdiv:
+				case e_vmod:
+					depth -= (unsigned char)o[0];
+					break;
+				case e_vsplat:
+					depth += (unsigned char)o[0] - 1;
+					break;
+				case e_vswizzle:
+					depth += (unsigned char)o[1] - (unsigned char)o[0];
+					break;
+				case e_vdot:
+					depth += 1 - 2 * (unsigned char)o[0];
+					break;
+				case e_vlength:
+					depth += 1 - (unsigned char)o[0];
+					break;
+				case e_vcross:
+					depth -= 3;
+					break;
+				case e_larg:
+					depth += (unsigned char)o[1];
+					break;
+				case e_sarg:
+					depth -= (unsigned char)o[1];
+					break;
+				case e_call:
+					{
+						unsigned int c = (unsigned char)o[4];
+						Label target = il_decode_u32(o);
+						if( known.count(target) == 0 )
+						{
+							function_depth& f = known[target];
+							f.width = il_depth( target, bytecode.size(), c, f.stack, f.nested, known );
+						}
+						const function_depth& f = known[target];
+						stack = depth - c + f.stack > stack ? depth - c + f.stack : stack;
+						nested = f.nested + 1 > nested ? f.nested + 1 : nested;
+						depth += f.width - c;
+					}
+					break;
+				case e_retv:
+					return (unsigned char)o[0];
+				default:
+					break;
+			}
+			stack = depth > (int)stack ? depth : stack;
+		}
+		return 0;
+	}
+
+	Label il_jmp(Label lbl)
+	{
+		il_add_bytecode_u8( e_jmp );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		return l;
+	}
+
+	void il_add()
+	{
+		il_add_bytecode_u8(e_add);
+	}
+
+	void il_sub()
+	{
+		il_add_bytecode_u8(e_sub);
+	}
+
+	void il_mul()
+	{
+		il_add_bytecode_u8(e_mul);
+	}
+
+	void il_div()
+	{
+		il_add_bytecode_u8(e_div);
+	}
+
+	void il_mod()
+	{
+		il_add_bytecode_u8(e_mod);
+	}
+
+	// Index of a value in the constant pool, values are compared bit for
+	// bit so 0.0 and -0.0 get their own entries.
+	unsigned int il_constant(float v)
+	{
+		for( unsigned int i = 0; i < constants.size(); ++i ) {
+			if( memcmp( &constants[i], &v, sizeof(float) ) == 0 )
+			{
+				return i;
+			}
+		}
+
+		constants.push_back(v);
+		return constants.size() - 1;
+	}
+
+	// Pushes a literal from the constant pool, the first 256 constants take 
+	// a one byte index and the rest two bytes. Only pools that outgrow that
+	// fall back to an inline float.
+	void il_push(float v)
+	{
+		unsigned int h;
+		if( half_constants && half_exact(v, h) )
+		{
+			bool pooled = false;
+			for( unsigned int k = 0; k < constants.size() && !pooled; ++k ) {
+				pooled = memcmp( &constants[k], &v, sizeof(float) ) == 0;
+			}
+
+			if( !pooled )
+			{
+				il_add_bytecode_u8( e_loadh );
+				il_add_bytecode_u16( h );
+				return;
+			}
+		}
+
+		unsigned int i = il_constant(v);
+		if( i < 0x100 ) {
+			il_add_bytecode_u8( e_loadk8 );
+			il_add_bytecode_u8( i );
+		} else if( i < 0x10000 ) {
+			il_add_bytecode_u8( e_loadk16 );
+			il_add_bytecode_u16( i );
+		} else {
+			il_add_bytecode_u8( e_load );
+			il_add_bytecode_flt( v );
+		}
+	}
+
+	void il_sin()
+	{
+		il_add_bytecode_u8( e_sin );
+	}
+
+	void il_cos()
+	{
+		il_add_bytecode_u8( e_cos );
+	}
+
+	void il_tan()
+	{
+		il_add_bytecode_u8( e_tan );
+	}
+
+	void il_sinh()
+	{
+		il_add_bytecode_u8( e_sinh );
+	}
+
+	void il_cosh()
+	{
+		il_add_bytecode_u8( e_cosh );
+	}
+
+	void il_tanh()
+	{
+		il_add_bytecode_u8( e_tanh );
+	}
+
+	void il_asin()
+	{
+		il_add_bytecode_u8( e_asin );
+	}
+
+	void il_acos()
+	{
+		il_add_bytecode_u8( e_acos );
+	}
+
+	void il_atan()
+	{
+		il_add_bytecode_u8( e_atan );
+	}
+
+	void il_lerp()
+	{
+		il_add_bytecode_u8( e_lerp );
+	}
+
+	void il_clamp()
+	{
+		il_add_bytecode_u8( e_clamp );
+	}
+
+	void il_sqrt()
+	{
+		il_add_bytecode_u8( e_sqrt );
+	}
+
+	void il_abs()
+	{
+		il_add_bytecode_u8( e_abs );
+	}
+
+	void il_sign()
+	{
+		il_add_bytecode_u8( e_sign );
+	}
+
+	void il_radians()
+	{
+		il_add_bytecode_u8( e_radians );
+	}
+
+	void il_degrees()
+	{
+		il_add_bytecode_u8( e_degrees );
+	}
+
+	void il_smoothstep()
+	{
+		il_add_bytecode_u8( e_smoothstep );
+	}
+
+	void il_floor()
+	{
+		il_add_bytecode_u8( e_floor );
+	}
+
+	void il_ceil()
+	{
+		il_add_bytecode_u8( e_ceil );
+	}
+
+	void il_round()
+	{
+		il_add_bytecode_u8( e_round );
+	}
+
+	void il_pop()
+	{
+		il_add_bytecode_u8( e_store );
+	}
+
+	void il_rand()
+	{
+		il_add_bytecode_u8( e_rand );
+	}
+
+	// Calls entry i of the builtin registry, builtins of the language have 
+	// an opcode of their own.
+	void il_builtin(unsigned int i)
+	{
+		const builtin& b = builtins()[i];
+		il_add_bytecode_u8( b.opcode );
+		if( b.opcode == e_native )
+		{
+			il_add_bytecode_var( i );
+		}
+	}
+
+	void il_sfld(Local lbl)
+	{
+		il_add_bytecode_u8( e_sfld );
+		il_add_bytecode_var( lbl );
+	}
+
+	void il_lfld(Local lbl)
+	{
+		il_add_bytecode_u8( e_lfld );
+		il_add_bytecode_var( lbl );
+	}
+
+	void il_ret()
+	{
+		il_add_bytecode_u8(e_ret);
+	}
+
+	// Starts a guarded statement, see statement_guard. Returns the label of
+	// the end of the statement for il_set_label_instr.
+	Label il_guard(unsigned int index)
+	{
+		il_add_bytecode_u8( e_guard );
+		Label l = il_get_label();
+		il_add_bytecode_u32( 0 );
+		il_add_bytecode_var( index );
+		return l;
+	}
+
+	// Ends the run of a particle and suspends it for the seconds on the 
+	// stack, the next run of the entry point continues after the wait once
+	// time has passed the wake up time. slot is the state of the entry, the
+	// stack must hold nothing else.
+	void il_wait(Local slot)
+	{
+		il_add_bytecode_u8( e_wait );
+		il_add_bytecode_var( slot );
+	}
+
+	// Vector instructions carry the width of their operands (2 to 4), 
+	// vector fields occupy consecutive slots starting at lbl.
+	void il_vlfld(Local lbl, unsigned int n)
+	{
+		il_add_bytecode_u8( e_vlfld );
+		il_add_bytecode_u8( n );
+		il_add_bytecode_var( lbl );
+	}
+
+	void il_vsfld(Local lbl, unsigned int n)
+	{
+		il_add_bytecode_u8( e_vsfld );
+		il_add_bytecode_u8( n );
+		il_add_bytecode_var( lbl );
+	}
+
+	void il_vsplat(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vsplat );
+		il_add_bytecode_u8( n );
+	}
+
+	// Selects m components out of an n wide vector, two bits per component
+	// of the result starting with the lowest bits.
+	void il_vswizzle(unsigned int n, unsigned int m, unsigned int mask)
+	{
+		il_add_bytecode_u8( e_vswizzle );
+		il_add_bytecode_u8( n );
+		il_add_bytecode_u8( m );
+		il_add_bytecode_u8( mask );
+	}
+
+	void il_vadd(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vadd );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vsub(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vsub );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vmul(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vmul );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vdiv(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vdiv );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vmod(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vmod );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vdot(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vdot );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vcross()
+	{
+		il_add_bytecode_u8( e_vcross );
+	}
+
+	void il_vlength(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vlength );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_vnormalize(unsigned int n)
+	{
+		il_add_bytecode_u8( e_vnormalize );
+		il_add_bytecode_u8( n );
+	}
+
+	// Calls a function whose arguments, n floats in total, are on the stack.
+	// The arguments and the locals reserved by il_enter form the frame that
+	// il_larg and il_sarg address, il_retv replaces it with the result.
+	Label il_call(Label lbl, unsigned int n)
+	{
+		il_add_bytecode_u8( e_call );
+		Label l = il_get_label();
+		il_add_bytecode_u32( lbl );
+		il_add_bytecode_u8( n );
+		return l;
+	}
+
+	void il_enter(unsigned int n)
+	{
+		il_add_bytecode_u8( e_enter );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_larg(unsigned int offset, unsigned int n)
+	{
+		il_add_bytecode_u8( e_larg );
+		il_add_bytecode_u8( offset );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_sarg(unsigned int offset, unsigned int n)
+	{
+		il_add_bytecode_u8( e_sarg );
+		il_add_bytecode_u8( offset );
+		il_add_bytecode_u8( n );
+	}
+
+	void il_retv(unsigned int n)
+	{
+		il_add_bytecode_u8( e_retv );
+		il_add_bytecode_u8( n );
+	}
+
+	// Gradient noise over the n (1 to 3) coordinates on the stack.
+	void il_noise(unsigned int n)
+	{
+		il_add_bytecode_u8( e_noise1 + n - 1 );
+	}
+
+	// Replaces the vec3 on the stack with curl noise.
+	void il_curl3()
+	{
+		il_add_bytecode_u8( e_curl3 );
+	}
+
+	// Replaces the time on the stack with the value of a baked curve.
+	void il_curve(unsigned int index)
+	{
+		il_add_bytecode_u8( e_curve );
+		il_add_bytecode_var( index );
+	}
+
+
+	// Runs an entry point once for every particle in [first, first + count)
+	// of the bound host storage, PEL_LANES particles at a time. The prologue
+	// runs once. Unbound fields are kept per particle while a group of lanes
+	// runs, afterwards the values of the last particle are written back to
+	// locals. Returns false without running anything when entry waits and
+	// the fields that keep where its particles continue are not bound, the
+	// particles would share them.
+	bool run_batch(unsigned int count, unsigned int entry = 0, unsigned int first = 0)
+	{
+		assert( count <= 1 || resumable(entry) );
+		if( count > 1 && resumable(entry) == false )
+		{
+			return false;
+		}
+
+		//Incremental runs look at what this batch writes on its own.
+		std::vector<unsigned int> before;
+		if( incremental )
+		{
+			before.swap(dirty);
+		}
+
+		run_prologue();
+		if( incremental )
+		{
+			guard_batch( entry, first, count );
+		}
+		run_context ctx = context();
+		run_range( ctx, count, entry, first );
+
+		if( incremental )
+		{
+			settle( before, entry );
+		}
+		return true;
+	}
+
+	// Runs entry over particles [first, first + count) like run_batch, but 
+	// neither runs the prologue nor looks at the guards. The unbound fields
+	// and the written bits live in ctx, the function itself is only read, so 
+	// threads may run the same function at once with a context each as long
+	// as their particles do not overlap.
+	void run_range(const run_context& ctx, unsigned int count, unsigned int entry = 0, unsigned int first = 0)
+	{
+		std::vector<lanes> regs( locals.size() );
+
+		//The constant pool is broadcast once, e_loadk copies a whole register.
+		std::vector<lanes> pool( constants.size() + 1 );
+		for( unsigned int i = 0; i < constants.size(); ++i ) {
+			lanes_splat( pool[i], constants[i] );
+		}
+
+		for( unsigned int i = 0; i < count; i += PEL_LANES ) {
+			run_lanes( ctx, entry, first + i, count - i < PEL_LANES ? count - i : PEL_LANES, &regs[0], &pool[0] );
+		}
+	}
+
+	// Decides which guarded statements of entry run_batch skips for particles
+	// [first, first + count). Unbound fields are compared with the values the
+	// last batch saw, bound fields changed when a run wrote them or the host
+	// touched them.
+	void guard_batch(unsigned int entry, unsigned int first, unsigned int count)
+	{
+		if( versions.size() < locals.size() )
+		{
+			versions.resize( locals.size(), 0 );
+		}
+		if( watched.size() < locals.size() )
+		{
+			watched.resize( locals.size(), 0.0f );
+		}
+
+		//Noise depends on the seed.
+		if( seed != watchedSeed )
+		{
+			for( unsigned int g = 0; g < guards.size(); ++g ) {
+				guards[g].ran = false;
+			}
+			watchedSeed = seed;
+		}
+
+		for( unsigned int i = 0; i < locals.size(); ++i ) {
+			if( il_bound(i) == false && memcmp(&locals[i], &watched[i], sizeof(float)) != 0 )
+			{
+				watched[i] = locals[i];
+				versions[i]++;
+			}
+		}
+
+		skips.assign( guards.size(), 0 );
+		for( unsigned int g = 0; g < guards.size(); ++g ) {
+			statement_guard& s = guards[g];
+			if( s.entry != entry )
+			{
+				continue;
+			}
+
+			bool skip = s.skippable && s.ran && s.first == first && s.count == count;
+			for( unsigned int k = 0; k < s.writes.size() && skip; ++k ) {
+				skip = il_bound( s.writes[k] );
+			}
+			for( unsigned int k = 0; k < s.reads.size() && skip; ++k ) {
+				skip = versions[s.reads[k]] == s.seen[k];
+			}
+			for( unsigned int k = 0; k < s.writes.size() && skip; ++k ) {
+				skip = versions[s.writes[k]] == s.seen[s.reads.size() + k];
+			}
+
+			if( skip )
+			{
+				skips[g] = 1;
+				continue;
+			}
+
+			s.ran = true;
+			s.first = first;
+			s.count = count;
+			s.seen.resize( s.reads.size() + s.writes.size() );
+			for( unsigned int k = 0; k < s.reads.size(); ++k ) {
+				s.seen[k] = versions[s.reads[k]];
+			}
+
+			//The statements after it that read what it writes have to run
+			//as well.
+			for( unsigned int k = 0; k < s.writes.size(); ++k ) {
+				versions[s.writes[k]]++;
+			}
+		}
+	}
+
+	// Bumps the versions of the bound fields a run wrote and adds them to 
+	// the fields before holds, what was dirty before the run. The guarded
+	// statements of entry that ran remember the versions of what they wrote,
+	// a statement that is skipped later must find its fields the way it left
+	// them.
+	void settle(std::vector<unsigned int>& before, int entry)
+	{
+		for( unsigned int i = 0; i < locals.size(); ++i ) {
+			if( il_bound(i) && (dirty[i >> 5] & (1u << (i & 31))) )
+			{
+				il_touch(i);
+			}
+		}
+
+		for( unsigned int g = 0; g < guards.size() && entry >= 0; ++g ) {
+			statement_guard& s = guards[g];
+			if( s.entry == (unsigned int)entry && skips[g] == 0 )
+			{
+				for( unsigned int k = 0; k < s.writes.size(); ++k ) {
+					s.seen[s.reads.size() + k] = versions[s.writes[k]];
+				}
+			}
+		}
+
+		for( unsigned int w = 0; w < before.size() && w < dirty.size(); ++w ) {
+			dirty[w] |= before[w];
+		}
+		skips.clear();
+	}
+
+	// Runs particles [first, first + n) in lock step, n is at most PEL_LANES.
+	// When the lanes disagree on a branch every lane finishes on the scalar
+	// interpreter instead, see diverge. pool holds the constant pool
+	// broadcast to every lane.
+	void run_lanes(const run_context& ctx, unsigned int entry, unsigned int first, unsigned int n, lanes* regs, const lanes* pool)
+	{
+		lanes stack[PEL_STACK_SIZE + 4];
+		lanes* sp = stack;
+		lanes* fp = stack;
+		char* calls[PEL_CALL_DEPTH];
+		lanes* frames[PEL_CALL_DEPTH];
+		unsigned int depth = 0;
+		unsigned int active = (1u << n) - 1;
+
+		//Temporaries are written before they are read, they stay in regs.
+		for( unsigned int i = 0; i < locals.size(); ++i ) {
+			if( il_bound(i) == false && il_temporary(i) == false )
+			{
+				lanes_splat( regs[i], ctx.locals[i] );
+			}
+			else if( il_bound(i) && bindings[i].next != 0 )
+			{
+				carry( i, first, n );
+			}
+		}
+
+		//Particles of a resumable entry point continue where they waited, 
+		//they run in lock step only when all of them are awake at the same
+		//point.
+		char* v = &bytecode[start(entry)];
+		if( entry < states.size() && states[entry] >= 0 )
+		{
+			char* wakes[PEL_LANES] = { 0 };
+			bool same = true;
+			for( unsigned int l = 0; l < n; ++l ) {
+				wakes[l] = wake( ctx, entry, first + l );
+				same = same && wakes[l] == wakes[0];
+			}
+
+			if( same == false || wakes[0] == 0 )
+			{
+				float column[PEL_STACK_SIZE + 4];
+				for( unsigned int l = 0; l < n; ++l ) {
+					if( wakes[l] == 0 )
+					{
+						continue;
+					}
+
+					for( unsigned int i = 0; i < locals.size(); ++i ) {
+						if( il_bound(i) == false )
+						{
+							ctx.locals[i] = regs[i].v[l];
+						}
+					}
+					resume( ctx, wakes[l], column, column, 0, 0, 0, first + l );
+				}
+				return;
+			}
+			v = wakes[0];
+		}
+
+		while( true ) 
+		{
+			char* pc = v;
+			switch( *(v++) ) 
+			{
+				case e_wait:
+					{
+						Local s = il_decode_var(v);
+						lanes a;
+						lanes_splat( a, (float)(v - &bytecode[0]) );
+						store_lanes( ctx, a, s, first, n, regs );
+						lanes_splat( a, time );
+						lanes_add( a, *--sp );
+						store_lanes( ctx, a, s + 1, first, n, regs );
+					}
+					//Falls through, the particles are done for this run.
+				case e_ret:
+					for( unsigned int i = 0; i < locals.size(); ++i ) {
+						if( il_bound(i) == false && il_temporary(i) == false )
+						{
+							ctx.locals[i] = regs[i].v[n - 1];
+						}
+					}
+					return;
+				case e_load:
+					lanes_splat( *sp++, il_decode_flt(v) );
+					v += 4;
+					break;
+				case e_loadk8:
+					*sp++ = pool[(unsigned char)*(v++)];
+					break;
+				case e_loadk16:
+					*sp++ = pool[il_decode_u16(v)];
+					v += 2;
+					break;
+				case e_loadh:
+					lanes_splat( *sp++, half_float(il_decode_u16(v)) );
+					v += 2;
+					break;
+				case e_store:
+					--sp;
+					break;
+				case e_lfld:
+					load_lanes( *sp++, il_decode_var(v), first, n, regs );
+					break;
+				case e_sfld:
+					store_lanes( ctx, *--sp, il_decode_var(v), first, n, regs );
+					break;
+				case e_add:
+					--sp;
+					lanes_add( sp[-1], sp[0] );
+					break;
+				case e_sub:
+					--sp;
+					lanes_sub( sp[-1], sp[0] );
+					break;
+				case e_mul:
+					--sp;
+					lanes_mul( sp[-1], sp[0] );
+					break;
+				case e_div:
+					--sp;
+					lanes_div( sp[-1], sp[0] );
+					break;
+				case e_mod:
+					--sp;
+					for( int l = 0; l < PEL_LANES; ++l ) {
+						sp[-1].v[l] = fmodf( sp[-1].v[l], sp[0].v[l] );
+					}
+					break;
+
+				case e_jmp:
+					v = &bytecode[il_decode_u32(v)];
+					break;
+				case e_guard:
+					{
+						char* end = &bytecode[il_decode_u32(v)];
+						v += 4;
+						unsigned int g = il_decode_var(v);
+						v = g < ctx.guards && ctx.skips[g] ? end : v;
+					}
+					break;
+
+				case e_eq:
+				case e_neq:
+				case e_elt:
+				case e_egt:
+				case e_lt:
+				case e_gt:
+					{
+						int op = 0;
+						switch( *pc )
+						{
+							case e_eq:  op = 1; break;
+							case e_neq: op = 2; break;
+							case e_elt: op = 3; break;
+							case e_egt: op = 4; break;
+							case e_lt:  op = 5; break;
+							case e_gt:  op = 6; break;
+						}
+
+						unsigned int taken = lanes_compare( sp[-2], sp[-1], op ) & active;
+						if( taken != 0 && taken != active )
+						{
+							diverge( ctx, pc, stack, sp, fp, calls, frames, depth, first, n, regs );
+							return;
+						}
+
+						sp -= 2;
+						if( taken != 0 ) {
+							v = &bytecode[il_decode_u32(v)];
+						} else {
+							v += 4;
+						}
+					}
+					break;
+
+				case e_tan:
+				case e_sin:
+				case e_cos:
+				case e_tanh:
+				case e_sinh:
+				case e_cosh:
+				case e_atan:
+				case e_asin:
+				case e_acos:
+				case e_clamp:
+				case e_lerp:
+				case e_smoothstep:
+				case e_sqrt:
+				case e_abs:
+				case e_sign:
+				case e_radians:
+				case e_degrees:
+				case e_ceil:
+				case e_floor:
+				case e_round:
+				case e_rand:
+					run_builtin( builtins().instruction(*pc), sp, n );
+					break;
 
-	void il_acos()
-	{
-		il_add_bytecode_u8( e_acos );
-	}
+				case e_vlfld:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						unsigned int i = il_decode_var(v);
+						for( unsigned int k = 0; k < c; ++k ) {
+							load_lanes( *sp++, i + k, first, n, regs );
+						}
+					}
+					break;
+				case e_vsfld:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						unsigned int i = il_decode_var(v);
+						sp -= c;
+						for( unsigned int k = 0; k < c; ++k ) {
+							store_lanes( ctx, sp[k], i + k, first, n, regs );
+						}
+					}
+					break;
+				case e_vsplat:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						lanes a = *--sp;
+						for( unsigned int k = 0; k < c; ++k ) {
+							*sp++ = a;
+						}
+					}
+					break;
+				case e_vswizzle:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						unsigned int m = (unsigned char)*(v++);
+						unsigned int mask = (unsigned char)*(v++);
+						lanes a[4];
+						sp -= c;
+						for( unsigned int k = 0; k < c; ++k ) {
+							a[k] = sp[k];
+						}
+						for( unsigned int k = 0; k < m; ++k ) {
+							*sp++ = a[(mask >> (k * 2)) & 3];
+						}
+					}
+					break;
+				case e_vadd:
+				case e_vsub:
+				case e_vmul:
+				case e_vdiv:
+				case e_vmod:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						sp -= c;
+						lanes* a = sp - c;
+						for( unsigned int k = 0; k < c; ++k ) {
+							switch( *pc )
+							{
+								case e_vadd: lanes_add( a[k], sp[k] ); break;
+								case e_vsub: lanes_sub( a[k], sp[k] ); break;
+								case e_vmul: lanes_mul( a[k], sp[k] ); break;
+								case e_vdiv: lanes_div( a[k], sp[k] ); break;
+								case e_vmod:
+									for( int l = 0; l < PEL_LANES; ++l ) {
+										a[k].v[l] = fmodf( a[k].v[l], sp[k].v[l] );
+									}
+									break;
+							}
+						}
+					}
+					break;
+				case e_vdot:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						sp -= c * 2;
+						lanes r = sp[0];
+						lanes_mul( r, sp[c] );
+						for( unsigned int k = 1; k < c; ++k ) {
+							lanes t = sp[k];
+							lanes_mul( t, sp[c + k] );
+							lanes_add( r, t );
+						}
+						*sp++ = r;
+					}
+					break;
+				case e_vcross:
+					{
+						sp -= 6;
+						lanes* a = sp;
+						lanes* b = sp + 3;
+						lanes c[3];
+						for( int l = 0; l < PEL_LANES; ++l ) {
+							c[0].v[l] = a[1].v[l] * b[2].v[l] - a[2].v[l] * b[1].v[l];
+							c[1].v[l] = a[2].v[l] * b[0].v[l] - a[0].v[l] * b[2].v[l];
+							c[2].v[l] = a[0].v[l] * b[1].v[l] - a[1].v[l] * b[0].v[l];
+						}
+						*sp++ = c[0]; *sp++ = c[1]; *sp++ = c[2];
+					}
+					break;
+				case e_vlength:
+				case e_vnormalize:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						lanes* a = sp - c;
+						lanes r = a[0];
+						lanes_mul( r, a[0] );
+						for( unsigned int k = 1; k < c; ++k ) {
+							lanes t = a[k];
+							lanes_mul( t, a[k] );
+							lanes_add( r, t );
+						}
+						lanes_map( r, sqrtf );
+						if( *pc == e_vlength )
+						{
+							sp = a;
+							*sp++ = r;
+						}
+						else
+						{
+							for( int l = 0; l < PEL_LANES; ++l ) {
+								r.v[l] = r.v[l] > 0.0f ? 1.0f / r.v[l] : 0.0f;
+							}
+							for( unsigned int k = 0; k < c; ++k ) {
+								lanes_mul( a[k], r );
+							}
+						}
+					}
+					break;
 
-	void il_atan()
-	{
-		il_add_bytecode_u8( e_atan );
-	}
+				case e_call:
+					{
+						unsigned int i = il_decode_u32(v);
+						unsigned int c = (unsigned char)v[4];
+						assert( depth < PEL_CALL_DEPTH );
+						calls[depth] = v + 5;
+						frames[depth] = fp;
+						depth++;
+						fp = sp - c;
+						v = &bytecode[i];
+					}
+					break;
+				case e_enter:
+					sp += (unsigned char)*(v++);
+					break;
+				case e_larg:
+					{
+						unsigned int i = (unsigned char)*(v++);
+						unsigned int c = (unsigned char)*(v++);
+						for( unsigned int k = 0; k < c; ++k ) {
+							*sp++ = fp[i + k];
+						}
+					}
+					break;
+				case e_sarg:
+					{
+						unsigned int i = (unsigned char)*(v++);
+						unsigned int c = (unsigned char)*(v++);
+						sp -= c;
+						for( unsigned int k = 0; k < c; ++k ) {
+							fp[i + k] = sp[k];
+						}
+					}
+					break;
+				case e_retv:
+					{
+						unsigned int c = (unsigned char)*(v++);
+						lanes* r = sp - c;
+						for( unsigned int k = 0; k < c; ++k ) {
+							fp[k] = r[k];
+						}
+						sp = fp + c;
+						depth--;
+						fp = frames[depth];
+						v = calls[depth];
+					}
+					break;
 
-	void il_lerp()
-	{
-		il_add_bytecode_u8( e_lerp );
-	}
+				case e_curve:
+					{
+						const curve& c = curves[il_decode_var(v)];
+						--sp;
+						lanes_sample( &tables[c.offset], PEL_CURVE_SAMPLES, c.width, c.start, c.scale, lanes(*sp), sp );
+						sp += c.width;
+					}
+					break;
 
-	void il_clamp()
-	{
-		il_add_bytecode_u8( e_clamp );
-	}
+				case e_noise1:
+				case e_noise2:
+				case e_noise3:
+					{
+						int c = *pc - e_noise1 + 1;
+						sp -= c;
+						lanes_noise( sp, c, seed, *sp );
+						sp++;
+					}
+					break;
+				case e_curl3:
+					lanes_curl3( sp - 3, seed, sp - 3 );
+					break;
 
-	void il_sqrt()
-	{
-		il_add_bytecode_u8( e_sqrt );
+				case e_native:
+					run_builtin( builtins()[il_decode_var(v)], sp, n );
+					break;
+			}
+		}
 	}
 
-	void il_abs()
+	// Finishes particles [first, first + n) on the scalar interpreter from pc.
+	// Every particle continues with its own column of the lane stack and its
+	// own values of the unbound fields.
+	void diverge(const run_context& ctx, char* pc, lanes* stack, lanes* sp, lanes* fp, char** calls, lanes** frames, unsigned int depth, unsigned int first, unsigned int n, lanes* regs)
 	{
-		il_add_bytecode_u8( e_abs );
-	}
+		float column[PEL_STACK_SIZE + 4];
+		float* columnFrames[PEL_CALL_DEPTH];
+		for( unsigned int d = 0; d < depth; ++d ) {
+			columnFrames[d] = column + (frames[d] - stack);
+		}
 
-	void il_sign()
-	{
-		il_add_bytecode_u8( e_sign );
-	}
+		unsigned int size = sp - stack;
+		for( unsigned int l = 0; l < n; ++l ) {
+			for( unsigned int k = 0; k < size; ++k ) {
+				column[k] = stack[k].v[l];
+			}
+			for( unsigned int i = 0; i < locals.size(); ++i ) {
+				if( il_bound(i) == false )
+				{
+					ctx.locals[i] = regs[i].v[l];
+				}
+			}
 
-	void il_radians()
-	{
-		il_add_bytecode_u8( e_radians );
+			resume( ctx, pc, column + size, column + (fp - stack), calls, columnFrames, depth, first + l );
+		}
 	}
 
-	void il_degrees()
+	Label start(unsigned int entry)
 	{
-		il_add_bytecode_u8( e_degrees );
+		return entries.empty() ? 0 : entries[entry];
 	}
 
-	void il_smoothstep()
+	// Whether every particle keeps its own place to continue entry: the entry
+	// point never waits or both of its state fields are bound.
+	bool resumable(unsigned int entry)
 	{
-		il_add_bytecode_u8( e_smoothstep );
+		int s = entry < states.size() ? states[entry] : -1;
+		return s < 0 || (il_bound(s) && il_bound(s + 1));
 	}
 
-	void il_floor()
+	// Where particle index continues entry, 0 while it waits.
+	char* wake(const run_context& ctx, unsigned int entry, unsigned int index)
 	{
-		il_add_bytecode_u8( e_floor );
-	}
+		int s = entry < states.size() ? states[entry] : -1;
+		float resume = s < 0 ? 0.0f : il_load(ctx, s, index);
+		if( resume == 0.0f )
+		{
+			return &bytecode[start(entry)];
+		}
 
-	void il_ceil()
-	{
-		il_add_bytecode_u8( e_ceil );
+		return time < il_load(ctx, s + 1, index) ? 0 : &bytecode[(unsigned int)resume];
 	}
 
-	void il_round()
+	void run_prologue()
 	{
-		il_add_bytecode_u8( e_round );
+		il_track();
+		if( entries.size() > 0 && entries[0] > 0 )
+		{
+			float stack[PEL_STACK_SIZE + 4];
+			resume( context(), &bytecode[0], stack, stack, 0, 0, 0, 0 );
+		}
 	}
 
-	void il_pop()
+	// The context of the runs of the function itself.
+	run_context context()
 	{
-		il_add_bytecode_u8( e_store );
+		il_track();
+		run_context ctx;
+		ctx.locals = &locals[0];
+		ctx.dirty = &dirty[0];
+		ctx.skips = skips.empty() ? 0 : &skips[0];
+		ctx.guards = skips.size();
+		return ctx;
 	}
 
-	void il_rand()
+	// Runs the prologue and an entry point for a single particle.
+	void run(unsigned int index = 0, unsigned int entry = 0)
 	{
-		il_add_bytecode_u8( e_rand );
-	}
+		float stack[PEL_STACK_SIZE + 4];
+		std::vector<unsigned int> before;
+		if( incremental )
+		{
+			before.swap(dirty);
+		}
 
-	void il_sfld(Local lbl)
-	{
-		il_add_bytecode_u8( e_sfld );
-		il_add_bytecode_u32( lbl );
-	}
+		run_prologue();
+		for( unsigned int i = 0; i < bindings.size(); ++i ) {
+			if( bindings[i].base != 0 && bindings[i].next != 0 )
+			{
+				carry( i, index, 1 );
+			}
+		}
+		run_context ctx = context();
+		if( char* v = wake(ctx, entry, index) )
+		{
+			resume( ctx, v, stack, stack, 0, 0, 0, index );
+		}
 
-	void il_lfld(Local lbl)
-	{
-		il_add_bytecode_u8( e_lfld );
-		il_add_bytecode_u32( lbl );
+		if( incremental )
+		{
+			settle( before, -1 );
+		}
 	}
 
-	void il_ret()
+	// Continues the scalar interpreter at v. sp and fp point into the stack 
+	// of the caller, calls and frames hold the return addresses and frame
+	// pointers of the depth functions that are being executed.
+	void resume(const run_context& ctx, char* v, float* sp, float* fp, char** from, float** fromFrames, unsigned int depth, unsigned int index)
 	{
-		il_add_bytecode_u8(e_ret);
-	}
-
+		char* calls[PEL_CALL_DEPTH];
+		float* frames[PEL_CALL_DEPTH];
+		for( unsigned int d = 0; d < depth; ++d ) {
+			calls[d] = from[d];
+			frames[d] = fromFrames[d];
+		}
 
-	void run(std::stack<float>& stack)
-	{
-		char* v = &bytecode[0];
 		while( true ) 
 		{
 			switch( *(v++) ) 
@@ -362,19 +2357,59 @@ public:
 					printf("return function\r\n");
 					#endif
 					return;				
+				case e_wait:
+					{
+						Local s = il_decode_var(v);
+						float a = *--sp;
+						il_store( ctx, s, index, (float)(v - &bytecode[0]) );
+						il_store( ctx, s + 1, index, time + a );
+						#ifndef NDEBUG
+						printf("wait %f\r\n", a);
+						#endif
+					}
+					return;
 				case e_load:
 					{
 						float i = il_decode_flt(v);
-						stack.push(i);
+						*sp++ = i;
 						#ifndef NDEBUG
 						printf("load stack %f\r\n", i);
 						#endif
 						v += 4;
 					}
 					break;
+				case e_loadk8:
+					{
+						unsigned int k = (unsigned char)*(v++);
+						*sp++ = constants[k];
+						#ifndef NDEBUG
+						printf("load constant %d %f\r\n", k, constants[k]);
+						#endif
+					}
+					break;
+				case e_loadk16:
+					{
+						unsigned int k = il_decode_u16(v);
+						*sp++ = constants[k];
+						#ifndef NDEBUG
+						printf("load constant %d %f\r\n", k, constants[k]);
+						#endif
+						v += 2;
+					}
+					break;
+				case e_loadh:
+					{
+						float a = half_float(il_decode_u16(v));
+						*sp++ = a;
+						#ifndef NDEBUG
+						printf("load half %f\r\n", a);
+						#endif
+						v += 2;
+					}
+					break;
 				case e_store:
 					{
-						stack.pop();
+						--sp;
 						#ifndef NDEBUG
 						printf("store stack\r\n");
 						#endif 
@@ -382,30 +2417,29 @@ public:
 					break;
 				case e_lfld:
 					{
-						unsigned int i = il_decode_u32(v);
+						unsigned int i = il_decode_var(v);
+						float a = il_load(ctx, i, index);
 						#ifndef NDEBUG
-						printf("load field %f [%d]\r\n", locals[i], i);
+						printf("load field %f [%d]\r\n", a, i);
 						#endif
-						stack.push(locals[i]);
-						v += 4;
+						*sp++ = a;
 					}
 					break;
 				case e_sfld:
 					{
-						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
+						unsigned int i = il_decode_var(v);
+						float a = *--sp;
 						#ifndef NDEBUG
 						printf("store field %f [%d]\r\n", a, i);
 						#endif
-						locals[i] = a;
-						v += 4;
+						il_store(ctx, i, index, a);
 					}
 					break;
 				case e_add:
 					{
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						stack.push( a + b );
+						float a = *--sp;
+						float b = *--sp;
+						*sp++ = a + b;
 						#ifndef NDEBUG
 						printf("add %f\r\n", a + b);
 						#endif
@@ -413,9 +2447,9 @@ public:
 					break;
 				case e_sub:
 					{
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						stack.push( a - b );
+						float b = *--sp;
+						float a = *--sp;
+						*sp++ = a - b;
 						#ifndef NDEBUG
 						printf("add %f\r\n", a - b);
 						#endif
@@ -423,9 +2457,9 @@ public:
 					break;
 				case e_mul:
 					{
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						stack.push( a * b );
+						float a = *--sp;
+						float b = *--sp;
+						*sp++ = a * b;
 						#ifndef NDEBUG
 						printf("add %f\r\n", a * b);
 						#endif
@@ -433,17 +2467,19 @@ public:
 					break;
 				case e_div:
 					{
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();						
-						stack.push( a / b );
-						printf("add %f\r\n", a / b);
+						float b = *--sp;
+						float a = *--sp;						
+						*sp++ = a / b;
+						#ifndef NDEBUG
+						printf("div %f\r\n", a / b);
+						#endif
 					}
 					break;
 				case e_mod:
 					{						
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();
-						stack.push( fmodf(a, b) );
+						float b = *--sp;
+						float a = *--sp;
+						*sp++ = fmodf(a, b);
 						#ifndef NDEBUG
 						printf("mod %f %f %f\r\n", a, b, fmodf(a, b) );
 						#endif
@@ -459,12 +2495,23 @@ public:
 						v = &bytecode[i];
 					}
 					break;
+				case e_guard:
+					{
+						char* end = &bytecode[il_decode_u32(v)];
+						v += 4;
+						unsigned int g = il_decode_var(v);
+						#ifndef NDEBUG
+						printf("guard %d\r\n", g);
+						#endif
+						v = g < ctx.guards && ctx.skips[g] ? end : v;
+					}
+					break;
 
 				case e_eq:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
 						printf("eq %f %f == %d\r\n", a, b, a == b);
 						#endif
@@ -478,10 +2525,10 @@ public:
 				case e_lt:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
-						printf("lt %f %f == %d\r\n", a, b, a <= b);
+						printf("lt %f %f == %d\r\n", a, b, a < b);
 						#endif
 						if( a < b ) {
 							v = &bytecode[i];
@@ -493,10 +2540,10 @@ public:
 				case e_gt:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
-						printf("gt %f %f == %d\r\n", a, b, a >= b);
+						printf("gt %f %f == %d\r\n", a, b, a > b);
 						#endif
 						if( a > b ) {
 							v = &bytecode[i];
@@ -508,10 +2555,10 @@ public:
 				case e_elt:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
-						printf("lt %f %f == %d\r\n", a, b, a <= b);
+						printf("elt %f %f == %d\r\n", a, b, a <= b);
 						#endif
 						if( a <= b ) {
 							v = &bytecode[i];
@@ -523,10 +2570,10 @@ public:
 				case e_egt:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
-						printf("gt %f %f == %d\r\n", a, b, a >= b);
+						printf("egt %f %f == %d\r\n", a, b, a >= b);
 						#endif
 						if( a >= b ) {
 							v = &bytecode[i];
@@ -538,222 +2585,322 @@ public:
 				case e_neq:
 					{
 						unsigned int i = il_decode_u32(v);
-						float a = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
+						float b = *--sp;
+						float a = *--sp;
 						#ifndef NDEBUG
 						printf("neq %f %f != %d\r\n", a, b, a != b);
 						#endif
 						if( a != b ) {
+							#ifndef NDEBUG
 							printf("\t jmp %d\r\n", i);
+							#endif
 							v = &bytecode[i];
 						} else {
 							v += 4;
 						}
 					}
 					break;
+				case e_tan:
+				case e_sin:
 				case e_cos:
+				case e_tanh:
+				case e_sinh:
+				case e_cosh:
+				case e_atan:
+				case e_asin:
+				case e_acos:
+				case e_clamp:
+				case e_lerp:
+				case e_smoothstep:
+				case e_sqrt:
+				case e_abs:
+				case e_sign:
+				case e_radians:
+				case e_degrees:
+				case e_ceil:
+				case e_floor:
+				case e_round:
+				case e_rand:
 					{
-						float a = stack.top(); stack.pop();
+						const builtin& b = builtins().instruction(v[-1]);
+						sp -= b.arity;
+						float a = b.scalar( sp );
 						#ifndef NDEBUG
-						printf("cos %f\r\n", a);
+						printf("%s %f\r\n", b.name.c_str(), a);
 						#endif
-						stack.push( cos(a) );
+						*sp++ = a;
 					}
 					break;
-				case e_sin:
+
+				case e_vlfld:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						unsigned int i = il_decode_var(v);
+						for( unsigned int k = 0; k < n; ++k ) {
+							*sp++ = il_load(ctx, i + k, index);
+						}
 						#ifndef NDEBUG
-						printf("sin %f\r\n", a);
+						printf("load vector field vec%d [%d]\r\n", n, i);
 						#endif
-						stack.push( sin(a) );
 					}
 					break;
-				case e_tan:
+				case e_vsfld:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						unsigned int i = il_decode_var(v);
+						sp -= n;
+						for( unsigned int k = 0; k < n; ++k ) {
+							il_store(ctx, i + k, index, sp[k]);
+						}
 						#ifndef NDEBUG
-						printf("tan %f\r\n", a);
+						printf("store vector field vec%d [%d]\r\n", n, i);
 						#endif
-						stack.push( tan(a) );
 					}
-					break;	
-				case e_cosh:
+					break;
+				case e_vsplat:
 					{
-						float a = stack.top(); stack.pop();
-						printf("cosh %f\r\n", a);
-						stack.push( cosh(a) );
+						unsigned int n = (unsigned char)*(v++);
+						float a = *--sp;
+						#ifndef NDEBUG
+						printf("splat vec%d %f\r\n", n, a);
+						#endif
+						vec_splat( sp, a );
+						sp += n;
 					}
 					break;
-				case e_sinh:
+				case e_vswizzle:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						unsigned int m = (unsigned char)*(v++);
+						unsigned int mask = (unsigned char)*(v++);
+						float a[4];
+						sp -= n;
+						for( unsigned int k = 0; k < n; ++k ) {
+							a[k] = sp[k];
+						}
+						for( unsigned int k = 0; k < m; ++k ) {
+							*sp++ = a[(mask >> (k * 2)) & 3];
+						}
 						#ifndef NDEBUG
-						printf("sinh %f\r\n", a);
+						printf("swizzle vec%d vec%d %x\r\n", n, m, mask);
 						#endif
-						stack.push( sinh(a) );
 					}
 					break;
-				case e_tanh:
+				case e_vadd:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						vec_add( sp - n, sp );
 						#ifndef NDEBUG
-						printf("tanh %f\r\n", a);
+						printf("add vec%d\r\n", n);
 						#endif
-						stack.push( tanh(a) );
 					}
-					break;	
-				case e_acos:
+					break;
+				case e_vsub:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						vec_sub( sp - n, sp );
 						#ifndef NDEBUG
-						printf("acos %f\r\n", a);
+						printf("sub vec%d\r\n", n);
 						#endif
-						stack.push( acos(a) );
 					}
 					break;
-				case e_asin:
+				case e_vmul:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						vec_mul( sp - n, sp );
 						#ifndef NDEBUG
-						printf("asin %f\r\n", a);
+						printf("mul vec%d\r\n", n);
 						#endif
-						stack.push( asin(a) );
 					}
 					break;
-				case e_atan:
+				case e_vdiv:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						vec_div( sp - n, sp );
 						#ifndef NDEBUG
-						printf("atan %f\r\n", a);
+						printf("div vec%d\r\n", n);
 						#endif
-						stack.push( atan(a) );
 					}
-					break;	
-				case e_lerp:
+					break;
+				case e_vmod:
+					{
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						float* a = sp - n;
+						for( unsigned int k = 0; k < n; ++k ) {
+							a[k] = fmodf( a[k], sp[k] );
+						}
+						#ifndef NDEBUG
+						printf("mod vec%d\r\n", n);
+						#endif
+					}
+					break;
+				case e_vdot:
 					{
-						float c = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n * 2;
+						float a = vec_dot( sp, sp + n, n );
 						#ifndef NDEBUG
-						printf("lerp %f %f %f\r\n", a, b, c);
-						#endif	
-						
-						float d = c > 1.0f ? 1.0f : ( c < 0.0f ? 0.0f : c );
-						stack.push( a + (b - a) * d );
+						printf("dot vec%d %f\r\n", n, a);
+						#endif
+						*sp++ = a;
 					}
 					break;
-				case e_clamp:
+				case e_vcross:
 					{
-						float c = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();
+						sp -= 6;
+						float* a = sp;
+						float* b = sp + 3;
+						float c[3] = { 
+							a[1] * b[2] - a[2] * b[1],
+							a[2] * b[0] - a[0] * b[2],
+							a[0] * b[1] - a[1] * b[0] 
+						};
 						#ifndef NDEBUG
-						printf("clamp %f %f %f\r\n", a, b, c);
+						printf("cross %f %f %f\r\n", c[0], c[1], c[2]);
 						#endif
-						float d = c > b ? b : ( c < a ? a : c );
-						stack.push( d );
+						*sp++ = c[0]; *sp++ = c[1]; *sp++ = c[2];
 					}
 					break;
-				case e_smoothstep:
+				case e_vlength:
 					{
-						float c = stack.top(); stack.pop();
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
+						float a = sqrtf( vec_dot( sp, sp, n ) );
 						#ifndef NDEBUG
-						printf("smoothstep %f %f %f\r\n", a, b, c);
+						printf("length vec%d %f\r\n", n, a);
 						#endif
-						
-						float r = (c - a) / (b - a);
-						float t = r > 1.0f ? 1.0f : ( r < 0.0f ? 0.0f : r );
-						stack.push( t * t * (3.0 - 2.0 * t) );
+						*sp++ = a;
 					}
-					break;				
-				case e_sqrt:
+					break;
+				case e_vnormalize:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						float a = sqrtf( vec_dot( sp - n, sp - n, n ) );
 						#ifndef NDEBUG
-						printf("sqrt %f\r\n", a);					
+						printf("normalize vec%d %f\r\n", n, a);
 						#endif
-						stack.push( sqrt(a) );
+						vec_scale( sp - n, a > 0.0f ? 1.0f / a : 0.0f );
 					}
 					break;
-				case e_abs:
+
+				case e_call:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int i = il_decode_u32(v);
+						unsigned int n = (unsigned char)v[4];
 						#ifndef NDEBUG
-						printf("abs %f\r\n", a);					
+						printf("call %d [%d]\r\n", i, n);
 						#endif
-						stack.push( fabs(a) );
+						assert( depth < PEL_CALL_DEPTH );
+						calls[depth] = v + 5;
+						frames[depth] = fp;
+						depth++;
+						fp = sp - n;
+						v = &bytecode[i];
 					}
 					break;
-				case e_sign:
+				case e_enter:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
 						#ifndef NDEBUG
-						printf("sign %f\r\n", a);					
+						printf("enter %d\r\n", n);
 						#endif
-						stack.push( a < 0 ? -1 : 1 );
+						sp += n;
 					}
 					break;
-				case e_radians:
+				case e_larg:
+					{
+						unsigned int i = (unsigned char)*(v++);
+						unsigned int n = (unsigned char)*(v++);
+						#ifndef NDEBUG
+						printf("load argument %f [%d]\r\n", fp[i], i);
+						#endif
+						for( unsigned int k = 0; k < n; ++k ) {
+							*sp++ = fp[i + k];
+						}
+					}
+					break;
+				case e_sarg:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int i = (unsigned char)*(v++);
+						unsigned int n = (unsigned char)*(v++);
+						sp -= n;
 						#ifndef NDEBUG
-						printf("radians %f\r\n", a);					
+						printf("store argument %f [%d]\r\n", sp[0], i);
 						#endif
-						stack.push( (3.14159265358979323846f * a) / 180.0f );
+						for( unsigned int k = 0; k < n; ++k ) {
+							fp[i + k] = sp[k];
+						}
 					}
 					break;
-				case e_degrees:
+				case e_retv:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int n = (unsigned char)*(v++);
+						float* r = sp - n;
 						#ifndef NDEBUG
-						printf("degrees %f\r\n", a);					
+						printf("return value %f\r\n", r[0]);
 						#endif
-						stack.push( (180 * a) / 3.14159265358979323846f );
+						for( unsigned int k = 0; k < n; ++k ) {
+							fp[k] = r[k];
+						}
+						sp = fp + n;
+						depth--;
+						fp = frames[depth];
+						v = calls[depth];
 					}
 					break;
 
-				case e_ceil:
+				case e_curve:
 					{
-						float a = stack.top(); stack.pop();
+						unsigned int i = il_decode_var(v);
+						const curve& c = curves[i];
+						float t = *--sp;
+						curve_sample( &tables[c.offset], PEL_CURVE_SAMPLES, c.width, c.start, c.scale, t, sp );
 						#ifndef NDEBUG
-						printf("ceil %f\r\n", a);					
+						printf("curve %s %f %f\r\n", c.name.c_str(), t, sp[0]);
 						#endif
-						stack.push( ceil(a) );
+						sp += c.width;
 					}
 					break;
-				case e_floor:
+
+				case e_noise1:
+				case e_noise2:
+				case e_noise3:
 					{
-						float a = stack.top(); stack.pop();
+						int n = *(v - 1) - e_noise1 + 1;
+						sp -= n;
+						float a = noise( sp, n, seed );
 						#ifndef NDEBUG
-						printf("floor %f\r\n", a);					
+						printf("noise%d %f\r\n", n, a);
 						#endif
-						stack.push( floor(a) );
+						*sp++ = a;
 					}
 					break;
-				case e_round:
+				case e_curl3:
 					{
-						float a = stack.top(); stack.pop();
+						float a[3];
+						curl3( sp - 3, seed, a );
 						#ifndef NDEBUG
-						printf("round %f\r\n", a);					
+						printf("curl3 %f %f %f\r\n", a[0], a[1], a[2]);
 						#endif
-						stack.push( a < 0.0 ? ceil(a - 0.5) : floor(a + 0.5) );
+						sp[-3] = a[0]; sp[-2] = a[1]; sp[-1] = a[2];
 					}
-					break;			
-				case e_rand:
+					break;
+				case e_native:
 					{
-						float b = stack.top(); stack.pop();
-						float a = stack.top(); stack.pop();
+						const builtin& b = builtins()[il_decode_var(v)];
+						sp -= b.arity;
+						float a = b.scalar( sp );
 						#ifndef NDEBUG
-						printf("rand %f %f\r\n", a, b);					
+						printf("native %s %f\r\n", b.name.c_str(), a);
 						#endif
-
-						double x = (double)rand()/(double)RAND_MAX * (b - a) + a;
-						stack.push( x );
+						*sp++ = a;
 					}
-					break;	
+					break;
 			}
 		}
 	}
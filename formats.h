@@ -0,0 +1,246 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+#include <math.h>
+#include <string.h>
+#include "lanes.h"
+
+#if defined(PEL_AVX2) && (defined(__F16C__) || defined(_MSC_VER))
+#define PEL_F16C
+#endif
+
+// How a field bound to host memory is stored, loads convert to float and
+// stores convert back. Fields that live in function::locals are always
+// floats.
+enum field_format
+{
+	format_float,
+	// IEEE half precision.
+	format_half,
+	// Unsigned byte, 0 to 255 maps onto 0.0 to 1.0.
+	format_unorm8,
+	// Signed short, -32767 to 32767 maps onto -1.0 to 1.0.
+	format_snorm16,
+};
+
+inline unsigned int format_size(field_format f)
+{
+	static const unsigned int sizes[] = { 4, 2, 1, 2 };
+	return sizes[f];
+}
+
+// Converts f to an IEEE half when that loses nothing, infinities and NaNs
+// are never converted.
+inline bool half_exact(float f, unsigned int& h)
+{
+	unsigned int bits;
+	memcpy( &bits, &f, sizeof(bits) );
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127;
+	unsigned int mantissa = bits & 0x7FFFFF;
+	if( (bits & 0x7FFFFFFF) == 0 )
+	{
+		h = sign;
+		return true;
+	}
+
+	if( exponent >= -14 && exponent <= 15 )
+	{
+		h = sign | ((exponent + 15) << 10) | (mantissa >> 13);
+		return (mantissa & 0x1FFF) == 0;
+	}
+
+	//Halves below 2^-14 have no implicit one.
+	if( exponent >= -24 && exponent < -14 )
+	{
+		unsigned int shift = -exponent - 1;
+		mantissa |= 0x800000;
+		h = sign | (mantissa >> shift);
+		return (mantissa & ((1u << shift) - 1)) == 0;
+	}
+
+	return false;
+}
+
+// Rounds f to the nearest half, ties to even like the F16C instructions.
+// Values too large for a half become infinity, NaNs stay quiet NaNs with
+// the top of their payload.
+inline unsigned int float_half(float f)
+{
+	unsigned int bits;
+	memcpy( &bits, &f, sizeof(bits) );
+	unsigned int sign = (bits >> 16) & 0x8000;
+	bits &= 0x7FFFFFFF;
+	if( bits >= 0x47800000 )
+	{
+		return sign | (bits > 0x7F800000 ? 0x7E00 | ((bits >> 13) & 0x3FF) : 0x7C00);
+	}
+
+	//Adding 0.5 lines the bits of a subnormal half up with the mantissa of
+	//the sum and lets the FPU do the rounding.
+	if( bits < 0x38800000 )
+	{
+		float a;
+		memcpy( &a, &bits, sizeof(a) );
+		a += 0.5f;
+		memcpy( &bits, &a, sizeof(bits) );
+		return sign | (bits - 0x3F000000);
+	}
+
+	bits += 0xC8000FFF + ((bits >> 13) & 1);
+	return sign | (bits >> 13);
+}
+
+inline float half_float(unsigned int h)
+{
+	unsigned int exponent = (h >> 10) & 0x1F;
+	unsigned int mantissa = h & 0x3FF;
+	float f;
+	if( exponent == 0 )
+	{
+		f = mantissa * 5.9604644775390625e-8f;
+		return (h & 0x8000) ? -f : f;
+	}
+
+	exponent = exponent == 0x1F ? 0xFF : exponent + 112;
+	unsigned int bits = ((h & 0x8000) << 16) | (exponent << 23) | (mantissa << 13);
+	memcpy( &f, &bits, sizeof(f) );
+	return f;
+}
+
+inline float format_load(const char* p, field_format f)
+{
+	switch( f )
+	{
+		case format_half:
+			return half_float( (unsigned char)p[0] | ((unsigned char)p[1] << 8) );
+		case format_unorm8:
+			return (unsigned char)p[0] * (1.0f / 255.0f);
+		case format_snorm16:
+			{
+				short s;
+				memcpy( &s, p, sizeof(s) );
+				float a = s * (1.0f / 32767.0f);
+				return a < -1.0f ? -1.0f : a;
+			}
+		default:
+			{
+				float a;
+				memcpy( &a, p, sizeof(a) );
+				return a;
+			}
+	}
+}
+
+// Values outside the range of a normalized format are clamped, NaN is
+// stored as the lowest value.
+inline void format_store(char* p, field_format f, float a)
+{
+	switch( f )
+	{
+		case format_half:
+			{
+				unsigned int h = float_half(a);
+				p[0] = (char)(h & 0xFF);
+				p[1] = (char)(h >> 8);
+			}
+			break;
+		case format_unorm8:
+			a = a > 0.0f ? a : 0.0f;
+			a = a < 1.0f ? a : 1.0f;
+			p[0] = (char)(unsigned char)(a * 255.0f + 0.5f);
+			break;
+		case format_snorm16:
+			{
+				a = a > -1.0f ? a : -1.0f;
+				a = a < 1.0f ? a : 1.0f;
+				short s = (short)floorf(a * 32767.0f + 0.5f);
+				memcpy( p, &s, sizeof(s) );
+			}
+			break;
+		default:
+			memcpy( p, &a, sizeof(a) );
+			break;
+	}
+}
+
+// Loads PEL_LANES consecutive values of format f.
+inline void lanes_unpack(lanes& a, const char* p, field_format f)
+{
+	#ifdef PEL_AVX2
+	switch( f )
+	{
+		case format_float:
+			_mm256_storeu_ps( a.v, _mm256_loadu_ps( reinterpret_cast<const float*>(p) ) );
+			return;
+		#ifdef PEL_F16C
+		case format_half:
+			_mm256_storeu_ps( a.v, _mm256_cvtph_ps( _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) ) ) );
+			return;
+		#endif
+		case format_unorm8:
+			{
+				__m256i i = _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i*>(p) ) );
+				_mm256_storeu_ps( a.v, _mm256_mul_ps( _mm256_cvtepi32_ps(i), _mm256_set1_ps(1.0f / 255.0f) ) );
+			}
+			return;
+		case format_snorm16:
+			{
+				__m256i i = _mm256_cvtepi16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) ) );
+				__m256 x = _mm256_mul_ps( _mm256_cvtepi32_ps(i), _mm256_set1_ps(1.0f / 32767.0f) );
+				_mm256_storeu_ps( a.v, _mm256_max_ps( x, _mm256_set1_ps(-1.0f) ) );
+			}
+			return;
+		default:
+			break;
+	}
+	#endif
+
+	unsigned int size = format_size(f);
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		a.v[l] = format_load( p + l * size, f );
+	}
+}
+
+// Stores PEL_LANES consecutive values of format f.
+inline void lanes_pack(const lanes& a, char* p, field_format f)
+{
+	#ifdef PEL_AVX2
+	switch( f )
+	{
+		case format_float:
+			_mm256_storeu_ps( reinterpret_cast<float*>(p), _mm256_loadu_ps(a.v) );
+			return;
+		#ifdef PEL_F16C
+		case format_half:
+			_mm_storeu_si128( reinterpret_cast<__m128i*>(p), _mm256_cvtps_ph( _mm256_loadu_ps(a.v), 0 ) );
+			return;
+		#endif
+		case format_unorm8:
+			{
+				__m256 x = _mm256_min_ps( _mm256_max_ps( _mm256_loadu_ps(a.v), _mm256_setzero_ps() ), _mm256_set1_ps(1.0f) );
+				x = _mm256_add_ps( _mm256_mul_ps( x, _mm256_set1_ps(255.0f) ), _mm256_set1_ps(0.5f) );
+				__m256i i = _mm256_cvttps_epi32(x);
+				__m128i w = _mm_packus_epi32( _mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1) );
+				_mm_storel_epi64( reinterpret_cast<__m128i*>(p), _mm_packus_epi16(w, w) );
+			}
+			return;
+		case format_snorm16:
+			{
+				__m256 x = _mm256_min_ps( _mm256_max_ps( _mm256_loadu_ps(a.v), _mm256_set1_ps(-1.0f) ), _mm256_set1_ps(1.0f) );
+				x = _mm256_floor_ps( _mm256_add_ps( _mm256_mul_ps( x, _mm256_set1_ps(32767.0f) ), _mm256_set1_ps(0.5f) ) );
+				__m256i i = _mm256_cvttps_epi32(x);
+				_mm_storeu_si128( reinterpret_cast<__m128i*>(p), _mm_packs_epi32( _mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1) ) );
+			}
+			return;
+		default:
+			break;
+	}
+	#endif
+
+	unsigned int size = format_size(f);
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		format_store( p + l * size, f, a.v[l] );
+	}
+}
+
+#endif //FORMATS_H
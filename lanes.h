@@ -0,0 +1,122 @@
+#ifndef LANES_H
+#define LANES_H
+#include <math.h>
+
+#if defined(__AVX2__)
+#define PEL_AVX2
+#include <immintrin.h>
+#endif
+
+// Number of particles the batch interpreter runs in lock step, each value on
+// its stack holds one float per particle.
+#define PEL_LANES 8
+
+struct lanes
+{
+	float v[PEL_LANES];
+};
+
+inline void lanes_splat(lanes& a, float b)
+{
+	#ifdef PEL_AVX2
+	_mm256_storeu_ps( a.v, _mm256_set1_ps(b) );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] = b;
+	#endif
+}
+
+inline void lanes_add(lanes& a, const lanes& b)
+{
+	#ifdef PEL_AVX2
+	_mm256_storeu_ps( a.v, _mm256_add_ps( _mm256_loadu_ps(a.v), _mm256_loadu_ps(b.v) ) );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] += b.v[l];
+	#endif
+}
+
+inline void lanes_sub(lanes& a, const lanes& b)
+{
+	#ifdef PEL_AVX2
+	_mm256_storeu_ps( a.v, _mm256_sub_ps( _mm256_loadu_ps(a.v), _mm256_loadu_ps(b.v) ) );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] -= b.v[l];
+	#endif
+}
+
+inline void lanes_mul(lanes& a, const lanes& b)
+{
+	#ifdef PEL_AVX2
+	_mm256_storeu_ps( a.v, _mm256_mul_ps( _mm256_loadu_ps(a.v), _mm256_loadu_ps(b.v) ) );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] *= b.v[l];
+	#endif
+}
+
+inline void lanes_div(lanes& a, const lanes& b)
+{
+	#ifdef PEL_AVX2
+	_mm256_storeu_ps( a.v, _mm256_div_ps( _mm256_loadu_ps(a.v), _mm256_loadu_ps(b.v) ) );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] /= b.v[l];
+	#endif
+}
+
+inline void lanes_map(lanes& a, float (*f)(float))
+{
+	for( int l = 0; l < PEL_LANES; ++l ) a.v[l] = f(a.v[l]);
+}
+
+// Bit l of the result is set when lane l of the comparison holds, op uses
+// the numbering of ComparisonExp (1 ==, 2 !=, 3 <=, 4 >=, 5 <, 6 >).
+inline unsigned int lanes_compare(const lanes& a, const lanes& b, int op)
+{
+	unsigned int mask = 0;
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		bool r = false;
+		switch( op )
+		{
+			case 1: r = a.v[l] == b.v[l]; break;
+			case 2: r = a.v[l] != b.v[l]; break;
+			case 3: r = a.v[l] <= b.v[l]; break;
+			case 4: r = a.v[l] >= b.v[l]; break;
+			case 5: r = a.v[l] <  b.v[l]; break;
+			case 6: r = a.v[l] >  b.v[l]; break;
+		}
+		mask |= (r ? 1u : 0u) << l;
+	}
+	return mask;
+}
+
+// Samples a baked lookup table for every lane. The table has count samples
+// of width floats each, t is mapped onto it with (t - start) * scale and
+// neighbouring samples are interpolated linearly. Component c of the
+// result is written to out[c].
+inline void lanes_sample(const float* lut, unsigned int count, unsigned int width, float start, float scale, const lanes& t, lanes* out)
+{
+	#ifdef PEL_AVX2
+	__m256 x = _mm256_mul_ps( _mm256_sub_ps( _mm256_loadu_ps(t.v), _mm256_set1_ps(start) ), _mm256_set1_ps(scale) );
+	x = _mm256_min_ps( _mm256_max_ps( x, _mm256_setzero_ps() ), _mm256_set1_ps( (float)(count - 1) ) );
+	__m256i i = _mm256_min_epi32( _mm256_cvttps_epi32(x), _mm256_set1_epi32( count - 2 ) );
+	__m256 f = _mm256_sub_ps( x, _mm256_cvtepi32_ps(i) );
+	__m256i k = _mm256_mullo_epi32( i, _mm256_set1_epi32( width ) );
+	for( unsigned int c = 0; c < width; ++c ) {
+		__m256 a = _mm256_i32gather_ps( lut + c, k, 4 );
+		__m256 b = _mm256_i32gather_ps( lut + c + width, k, 4 );
+		_mm256_storeu_ps( out[c].v, _mm256_add_ps( a, _mm256_mul_ps( _mm256_sub_ps(b, a), f ) ) );
+	}
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		float x = (t.v[l] - start) * scale;
+		x = x < 0.0f ? 0.0f : ( x > count - 1 ? count - 1 : x );
+		unsigned int i = (unsigned int)x;
+		i = i > count - 2 ? count - 2 : i;
+		float f = x - i;
+		const float* a = lut + i * width;
+		for( unsigned int c = 0; c < width; ++c ) {
+			out[c].v[l] = a[c] + (a[c + width] - a[c]) * f;
+		}
+	}
+	#endif
+}
+
+#endif //LANES_H
@@ -0,0 +1,191 @@
+#ifndef NOISE_H
+#define NOISE_H
+#include <math.h>
+#include "lanes.h"
+
+// Gradient noise in one to three dimensions. The kernel is written once as
+// a template over the float and integer types it computes with, so the
+// scalar reference and the AVX2 version that runs eight lanes at a time
+// produce the same values for the same seed.
+
+inline float noise_floor(float a) { return floorf(a); }
+inline unsigned int noise_int(float a) { return (unsigned int)(int)a; }
+inline float noise_float(unsigned int a) { return (float)(int)a; }
+
+#ifdef PEL_AVX2
+struct f8
+{
+	__m256 v;
+	f8() {}
+	f8(__m256 a) : v(a) {}
+	f8(float a) : v(_mm256_set1_ps(a)) {}
+};
+
+struct i8
+{
+	__m256i v;
+	i8() {}
+	i8(__m256i a) : v(a) {}
+	i8(unsigned int a) : v(_mm256_set1_epi32(a)) {}
+};
+
+inline f8 operator+(const f8& a, const f8& b) { return _mm256_add_ps(a.v, b.v); }
+inline f8 operator-(const f8& a, const f8& b) { return _mm256_sub_ps(a.v, b.v); }
+inline f8 operator*(const f8& a, const f8& b) { return _mm256_mul_ps(a.v, b.v); }
+inline i8 operator+(const i8& a, const i8& b) { return _mm256_add_epi32(a.v, b.v); }
+inline i8 operator*(const i8& a, const i8& b) { return _mm256_mullo_epi32(a.v, b.v); }
+inline i8 operator^(const i8& a, const i8& b) { return _mm256_xor_si256(a.v, b.v); }
+inline i8 operator&(const i8& a, const i8& b) { return _mm256_and_si256(a.v, b.v); }
+inline i8 operator>>(const i8& a, int n) { return _mm256_srl_epi32(a.v, _mm_cvtsi32_si128(n)); }
+
+inline f8 noise_floor(const f8& a) { return _mm256_floor_ps(a.v); }
+inline i8 noise_int(const f8& a) { return _mm256_cvttps_epi32(a.v); }
+inline f8 noise_float(const i8& a) { return _mm256_cvtepi32_ps(a.v); }
+#endif
+
+// Hashes the integer coordinates of a lattice point, every coordinate is
+// mixed in separately so that swapping them gives a different hash.
+template<class I>
+inline I noise_hash(const I* p, int n, I seed)
+{
+	I h = seed;
+	for( int k = 0; k < n; ++k ) {
+		h = (h ^ p[k]) * I(0x27d4eb2du);
+		h = h ^ (h >> 15);
+	}
+	h = h * I(0x2c1b3c6du);
+	return h ^ (h >> 12);
+}
+
+// Gradient noise over n (1 to 3) dimensions at p. Every lattice point gets
+// a gradient from its hash, the dot products with the offsets to the
+// corners are blended with a quintic fade. When d is not null it receives
+// the analytic derivative along every dimension.
+template<class F, class I>
+inline F noise_kernel(const F* p, int n, I seed, F* d)
+{
+	F f[3], u[3], du[3];
+	I i[3];
+	for( int k = 0; k < n; ++k ) {
+		F a = noise_floor(p[k]);
+		i[k] = noise_int(a);
+		f[k] = p[k] - a;
+		u[k] = f[k] * f[k] * f[k] * (f[k] * (f[k] * F(6.0f) - F(15.0f)) + F(10.0f));
+		du[k] = f[k] * f[k] * (f[k] - F(1.0f)) * (f[k] - F(1.0f)) * F(30.0f);
+	}
+
+	// Corner c lies at i + the bits of c, bit k for dimension k.
+	F v[8], g[8][3];
+	for( int c = 0; c < (1 << n); ++c ) {
+		I q[3];
+		for( int k = 0; k < n; ++k ) {
+			q[k] = i[k] + I((unsigned int)(c >> k) & 1);
+		}
+
+		I h = noise_hash(q, n, seed);
+		v[c] = F(0.0f);
+		for( int k = 0; k < n; ++k ) {
+			g[c][k] = noise_float( (h >> (k * 8)) & I(255u) ) * F(2.0f / 255.0f) - F(1.0f);
+			v[c] = v[c] + g[c][k] * (f[k] - F((float)((c >> k) & 1)));
+		}
+	}
+
+	// Blend pairs of corners one dimension at a time, the derivative of the
+	// blend is that of the gradients plus the slope of the fade.
+	for( int k = 0; k < n; ++k ) {
+		for( int j = 0; j < (1 << (n - 1 - k)); ++j ) {
+			F a = v[2 * j], b = v[2 * j + 1];
+			for( int m = 0; m < n; ++m ) {
+				g[j][m] = g[2 * j][m] + u[k] * (g[2 * j + 1][m] - g[2 * j][m]);
+			}
+			g[j][k] = g[j][k] + du[k] * (b - a);
+			v[j] = a + u[k] * (b - a);
+		}
+	}
+
+	// Scales the result to roughly [-1, 1].
+	static const float scale[3] = { 2.0f, 1.4f, 1.3f };
+	F s( scale[n - 1] );
+	if( d != 0 )
+	{
+		for( int k = 0; k < n; ++k ) {
+			d[k] = g[0][k] * s;
+		}
+	}
+
+	return v[0] * s;
+}
+
+// Divergence free noise, the curl of a potential made of three gradient
+// noise fields with different seeds.
+template<class F, class I>
+inline void curl_kernel(const F* p, I seed, F* out)
+{
+	F a[3], b[3], c[3];
+	noise_kernel(p, 3, seed, a);
+	noise_kernel(p, 3, seed ^ I(0x9e3779b9u), b);
+	noise_kernel(p, 3, seed ^ I(0x7f4a7c15u), c);
+	out[0] = c[1] - b[2];
+	out[1] = a[2] - c[0];
+	out[2] = b[0] - a[1];
+}
+
+// Scalar reference, p holds n coordinates.
+inline float noise(const float* p, int n, unsigned int seed)
+{
+	return noise_kernel<float, unsigned int>(p, n, seed, 0);
+}
+
+inline void curl3(const float* p, unsigned int seed, float* out)
+{
+	curl_kernel<float, unsigned int>(p, seed, out);
+}
+
+// Noise for every lane, p holds n coordinates.
+inline void lanes_noise(const lanes* p, int n, unsigned int seed, lanes& out)
+{
+	#ifdef PEL_AVX2
+	f8 q[3];
+	for( int k = 0; k < n; ++k ) {
+		q[k] = _mm256_loadu_ps(p[k].v);
+	}
+	_mm256_storeu_ps( out.v, noise_kernel<f8, i8>(q, n, i8(seed), 0).v );
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		float q[3];
+		for( int k = 0; k < n; ++k ) {
+			q[k] = p[k].v[l];
+		}
+		out.v[l] = noise(q, n, seed);
+	}
+	#endif
+}
+
+// Curl noise for every lane, p and out hold three coordinates and may be
+// the same.
+inline void lanes_curl3(const lanes* p, unsigned int seed, lanes* out)
+{
+	#ifdef PEL_AVX2
+	f8 q[3], r[3];
+	for( int k = 0; k < 3; ++k ) {
+		q[k] = _mm256_loadu_ps(p[k].v);
+	}
+	curl_kernel<f8, i8>(q, i8(seed), r);
+	for( int k = 0; k < 3; ++k ) {
+		_mm256_storeu_ps( out[k].v, r[k].v );
+	}
+	#else
+	for( int l = 0; l < PEL_LANES; ++l ) {
+		float q[3], r[3];
+		for( int k = 0; k < 3; ++k ) {
+			q[k] = p[k].v[l];
+		}
+		curl3(q, seed, r);
+		for( int k = 0; k < 3; ++k ) {
+			out[k].v[l] = r[k];
+		}
+	}
+	#endif
+}
+
+#endif //NOISE_H
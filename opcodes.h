@@ -0,0 +1,89 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+// Instructions of the interpreter, operands follow the opcode byte.
+enum opcode
+{	
+	e_ret,
+	e_load,
+	e_store,
+	e_add,
+	e_sub,
+	e_mul,
+	e_div,
+	e_mod,
+
+	
+	e_jmp,
+	e_eq,
+	e_lt,
+	e_gt,
+	e_elt,
+	e_egt,
+	e_neq,
+	
+	e_lfld,
+	e_sfld,
+
+	e_tan,
+	e_sin,
+	e_cos,
+	e_tanh,
+	e_sinh,
+	e_cosh,
+	e_atan,
+	e_asin,
+	e_acos,
+
+	e_clamp,
+	e_lerp,
+	e_smoothstep,
+	e_sqrt,
+	e_abs,
+	e_sign,
+	e_radians,
+	e_degrees,
+	e_ceil,
+	e_floor,
+	e_round,
+	e_rand,
+
+	e_vlfld,
+	e_vsfld,
+	e_vsplat,
+	e_vswizzle,
+	e_vadd,
+	e_vsub,
+	e_vmul,
+	e_vdiv,
+	e_vmod,
+	e_vdot,
+	e_vcross,
+	e_vlength,
+	e_vnormalize,
+
+	e_call,
+	e_enter,
+	e_larg,
+	e_sarg,
+	e_retv,
+
+	e_curve,
+
+	e_noise1,
+	e_noise2,
+	e_noise3,
+	e_curl3,
+
+	e_loadk8,
+	e_loadk16,
+
+	e_native,
+
+	e_loadh,
+
+	e_wait,
+	e_guard,
+};
+
+#endif //OPCODES_H
@@ -0,0 +1,420 @@
+#include "compiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+// Runs a compiled program over every particle of a particle file and writes
+// the result to a second one. Both files are mapped a chunk at a time, so
+// files larger than memory work.
+//
+//	pelbatch [-e entry] [-t threads] [-n count] [-s name=value] script input output
+//
+// A particle file starts with a particle_header and a particle_column for
+// every field, followed by the columns. A column holds count values of its
+// format back to back and starts at a multiple of PEL_FILE_ALIGNMENT, so
+// every chunk of a column can be mapped on its own. The output has the same
+// layout as the input. Columns the program has no field for are copied,
+// persistent fields without a column are an error. An input of - creates
+// count zeroed particles with a column for every persistent field, which
+// bakes a spawn entry point from scratch.
+
+#define PEL_FILE_MAGIC 0x504C4550	// "PELP"
+#define PEL_FILE_VERSION 1
+#define PEL_FILE_ALIGNMENT 65536
+// Particles mapped at a time, a multiple of PEL_FILE_ALIGNMENT keeps the
+// chunks of every column aligned.
+#define PEL_FILE_CHUNK (1 << 20)
+
+struct particle_header
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int columns;
+	unsigned int reserved;
+	unsigned long long count;
+};
+
+struct particle_column
+{
+	char name[48];
+	unsigned int format;
+	unsigned int reserved;
+	unsigned long long offset;
+};
+
+// A file that is mapped a view at a time.
+struct mapped_file
+{
+	#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+	#else
+	int file;
+	#endif
+	bool writable;
+	unsigned long long size;
+};
+
+// Opens name for reading, or creates it with size bytes for writing.
+static bool map_open(mapped_file& f, const char* name, bool writable, unsigned long long size)
+{
+	f.writable = writable;
+	f.size = size;
+	#if defined(_WIN32)
+	f.file = CreateFileA(name, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, 0,
+		writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if( f.file == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+
+	LARGE_INTEGER length;
+	if( writable )
+	{
+		length.QuadPart = size;
+		SetFilePointerEx(f.file, length, 0, FILE_BEGIN);
+		SetEndOfFile(f.file);
+	}
+	GetFileSizeEx(f.file, &length);
+	f.size = length.QuadPart;
+	f.mapping = f.size ? CreateFileMappingA(f.file, 0, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0) : 0;
+	if( f.size && f.mapping == 0 )
+	{
+		CloseHandle(f.file);
+		return false;
+	}
+	#else
+	f.file = writable ? open(name, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(name, O_RDONLY);
+	if( f.file < 0 )
+	{
+		return false;
+	}
+
+	if( writable && ftruncate(f.file, size) != 0 )
+	{
+		close(f.file);
+		return false;
+	}
+
+	struct stat info;
+	fstat(f.file, &info);
+	f.size = info.st_size;
+	#endif
+	return true;
+}
+
+// Maps size bytes at offset, offset must be a multiple of
+// PEL_FILE_ALIGNMENT.
+static char* map_view(mapped_file& f, unsigned long long offset, size_t size)
+{
+	if( size == 0 || offset + size > f.size )
+	{
+		return 0;
+	}
+
+	#if defined(_WIN32)
+	void* p = MapViewOfFile(f.mapping, f.writable ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, size);
+	return static_cast<char*>(p);
+	#else
+	void* p = mmap(0, size, f.writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f.file, offset);
+	return p == MAP_FAILED ? 0 : static_cast<char*>(p);
+	#endif
+}
+
+static void map_unview(char* p, size_t size)
+{
+	if( p == 0 )
+	{
+		return;
+	}
+
+	#if defined(_WIN32)
+	UnmapViewOfFile(p);
+	#else
+	munmap(p, size);
+	#endif
+}
+
+static void map_close(mapped_file& f)
+{
+	#if defined(_WIN32)
+	if( f.mapping )
+	{
+		CloseHandle(f.mapping);
+	}
+	CloseHandle(f.file);
+	#else
+	close(f.file);
+	#endif
+}
+
+static unsigned long long align_file(unsigned long long offset)
+{
+	return (offset + PEL_FILE_ALIGNMENT - 1) / PEL_FILE_ALIGNMENT * PEL_FILE_ALIGNMENT;
+}
+
+// Reads the header and the column table of a particle file.
+static bool read_layout(mapped_file& f, particle_header& header, std::vector<particle_column>& columns)
+{
+	if( f.size < sizeof(header) )
+	{
+		return false;
+	}
+
+	char* view = map_view(f, 0, sizeof(header));
+	if( view == 0 )
+	{
+		return false;
+	}
+
+	memcpy( &header, view, sizeof(header) );
+	map_unview(view, sizeof(header));
+	if( header.magic != PEL_FILE_MAGIC || header.version != PEL_FILE_VERSION )
+	{
+		return false;
+	}
+
+	size_t size = sizeof(header) + header.columns * sizeof(particle_column);
+	view = map_view(f, 0, size);
+	if( view == 0 )
+	{
+		return false;
+	}
+
+	columns.resize( header.columns );
+	if( header.columns )
+	{
+		memcpy( &columns[0], view + sizeof(header), header.columns * sizeof(particle_column) );
+	}
+	map_unview(view, size);
+
+	for( unsigned int i = 0; i < columns.size(); ++i ) {
+		columns[i].name[sizeof(columns[i].name) - 1] = 0;
+		if( columns[i].format > format_snorm16 || columns[i].offset % PEL_FILE_ALIGNMENT != 0 ||
+			columns[i].offset + header.count * format_size((field_format)columns[i].format) > f.size )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Lays out a column for every persistent field of program, returns the size
+// of the file.
+static unsigned long long create_layout(function& program, unsigned long long count, particle_header& header, std::vector<particle_column>& columns)
+{
+	for( unsigned int i = 0; i < program.localNames.size(); ++i ) {
+		const std::string& name = program.localNames[i];
+		if( program.usage(name) == usage_persistent && name.size() < sizeof(columns[0].name) )
+		{
+			particle_column c;
+			memset( &c, 0, sizeof(c) );
+			strcpy( c.name, name.c_str() );
+			c.format = program.format(name);
+			columns.push_back(c);
+		}
+	}
+
+	header.magic = PEL_FILE_MAGIC;
+	header.version = PEL_FILE_VERSION;
+	header.columns = columns.size();
+	header.reserved = 0;
+	header.count = count;
+
+	unsigned long long offset = sizeof(header) + columns.size() * sizeof(particle_column);
+	for( unsigned int i = 0; i < columns.size(); ++i ) {
+		columns[i].offset = offset = align_file(offset);
+		offset += count * format_size((field_format)columns[i].format);
+	}
+	return offset;
+}
+
+// Writes the header and the column table of a particle file, false when
+// they cannot be mapped.
+static bool write_layout(mapped_file& f, const particle_header& header, const std::vector<particle_column>& columns)
+{
+	size_t size = sizeof(header) + columns.size() * sizeof(particle_column);
+	char* view = map_view(f, 0, size);
+	if( view == 0 )
+	{
+		return false;
+	}
+
+	memcpy( view, &header, sizeof(header) );
+	if( columns.size() )
+	{
+		memcpy( view + sizeof(header), &columns[0], columns.size() * sizeof(particle_column) );
+	}
+	map_unview(view, size);
+	return true;
+}
+
+static int print_usage()
+{
+	printf("-- usage: pelbatch [-e entry] [-t threads] [-n count] [-s name=value] script input|- output\r\n");
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* entryName = 0;
+	unsigned int threads = 0;
+	unsigned long long count = 0;
+	std::vector<std::string> settings, files;
+	for( int i = 1; i < argc; ++i ) {
+		std::string a = argv[i];
+		if( a.size() == 2 && a[0] == '-' && a[1] != '-' && i + 1 < argc )
+		{
+			const char* v = argv[++i];
+			switch( a[1] )
+			{
+				case 'e': entryName = v; break;
+				case 't': threads = atoi(v); break;
+				case 'n': count = strtoul(v, 0, 10); break;
+				case 's': settings.push_back(v); break;
+				default: return print_usage();
+			}
+		}
+		else
+		{
+			files.push_back(a);
+		}
+	}
+
+	if( files.size() != 3 )
+	{
+		return print_usage();
+	}
+
+	std::string source;
+	if( read_file(files[0], source) == false )
+	{
+		printf("-- cannot read %s\r\n", files[0].c_str());
+		return 1;
+	}
+
+	function program;
+	if( compile(source.c_str(), source.size(), program) != 0 )
+	{
+		return 1;
+	}
+
+	int entry = entryName ? program.entry_point(entryName) : 0;
+	if( entry < 0 )
+	{
+		printf("-- %s has no entry point %s\r\n", files[0].c_str(), entryName);
+		return 1;
+	}
+
+	for( unsigned int i = 0; i < settings.size(); ++i ) {
+		size_t equals = settings[i].find('=');
+		std::string name = settings[i].substr(0, equals);
+		unsigned int slot = std::find(program.localNames.begin(), program.localNames.end(), name) - program.localNames.begin();
+		if( equals == std::string::npos || slot == program.localNames.size() )
+		{
+			printf("-- %s is not a field of %s\r\n", name.c_str(), files[0].c_str());
+			return 1;
+		}
+		program.locals[slot] = (float)atof( settings[i].c_str() + equals + 1 );
+	}
+
+	//The output has the layout of the input, or a new one for every
+	//persistent field.
+	mapped_file in, out;
+	particle_header header;
+	std::vector<particle_column> columns;
+	bool create = files[1] == "-";
+	unsigned long long size = 0;
+	if( create )
+	{
+		size = create_layout(program, count, header, columns);
+	}
+	else
+	{
+		if( map_open(in, files[1].c_str(), false, 0) == false || read_layout(in, header, columns) == false )
+		{
+			printf("-- %s is not a particle file\r\n", files[1].c_str());
+			return 1;
+		}
+		size = in.size;
+	}
+
+	if( map_open(out, files[2].c_str(), true, size) == false || write_layout(out, header, columns) == false )
+	{
+		printf("-- cannot create %s\r\n", files[2].c_str());
+		return 1;
+	}
+
+	int errors = 0;
+	for( unsigned int i = 0; i < program.localNames.size(); ++i ) {
+		const std::string& name = program.localNames[i];
+		bool found = false;
+		for( unsigned int c = 0; c < columns.size(); ++c ) {
+			found = found || name == columns[c].name;
+		}
+		if( found == false && program.usage(name) == usage_persistent )
+		{
+			printf("-- %s has no column %s\r\n", files[1].c_str(), name.c_str());
+			errors++;
+		}
+	}
+
+	double start = wall_seconds();
+	for( unsigned long long first = 0; first < header.count && errors == 0; first += PEL_FILE_CHUNK ) {
+		unsigned int n = header.count - first < PEL_FILE_CHUNK ? (unsigned int)(header.count - first) : PEL_FILE_CHUNK;
+		std::vector<char*> sources( columns.size() ), targets( columns.size() );
+		for( unsigned int c = 0; c < columns.size(); ++c ) {
+			field_format format = (field_format)columns[c].format;
+			size_t bytes = n * format_size(format);
+			unsigned long long offset = columns[c].offset + first * format_size(format);
+			sources[c] = create ? 0 : map_view(in, offset, bytes);
+			targets[c] = map_view(out, offset, bytes);
+			if( targets[c] == 0 || (create == false && sources[c] == 0) )
+			{
+				printf("-- cannot map %s\r\n", columns[c].name);
+				errors++;
+			}
+			else if( create )
+			{
+				program.bind( columns[c].name, targets[c], format_size(format), format );
+			}
+			else if( program.bind_double( columns[c].name, sources[c], targets[c], format_size(format), format ) == false )
+			{
+				memcpy( targets[c], sources[c], bytes );
+			}
+		}
+
+		if( errors == 0 )
+		{
+			run_parallel(program, n, entry, threads);
+		}
+
+		program.unbind_all();
+		for( unsigned int c = 0; c < columns.size(); ++c ) {
+			size_t bytes = n * format_size((field_format)columns[c].format);
+			map_unview(sources[c], bytes);
+			map_unview(targets[c], bytes);
+		}
+	}
+	double elapsed = wall_seconds() - start;
+
+	if( create == false )
+	{
+		map_close(in);
+	}
+	map_close(out);
+
+	if( errors == 0 )
+	{
+		printf("%llu particles, %u columns: %.3f ms, %.2f ns per particle\r\n", header.count, header.columns,
+			elapsed * 1e3, header.count ? elapsed * 1e9 / header.count : 0.0);
+	}
+	return errors != 0;
+}
@@ -0,0 +1,226 @@
+#ifndef POOL_H
+#define POOL_H
+#include "expression.h"
+
+// Order of the lanes that survive for every mask of PEL_LANES bits, the
+// lanes whose bit is set come first. Filled on first use.
+inline const unsigned int* compact_table()
+{
+	static unsigned int table[256 * PEL_LANES];
+	static bool filled = false;
+	if( filled == false )
+	{
+		for( unsigned int mask = 0; mask < 256; ++mask ) {
+			unsigned int n = 0;
+			for( unsigned int l = 0; l < PEL_LANES; ++l ) {
+				if( mask & (1u << l) )
+				{
+					table[mask * PEL_LANES + n++] = l;
+				}
+			}
+			for( ; n < PEL_LANES; ++n ) {
+				table[mask * PEL_LANES + n] = 0;
+			}
+		}
+		filled = true;
+	}
+	return table;
+}
+
+// Copies the values of src whose bit is set in mask to dst, in order, and
+// returns how many there were. Values are size bytes, src holds PEL_LANES
+// of them and dst must have room for PEL_LANES. dst may overlap src as long
+// as it does not start after it.
+inline unsigned int compact_lanes(const char* src, char* dst, unsigned int mask, unsigned int size)
+{
+	unsigned int n = 0;
+	#ifdef PEL_AVX2
+	if( size == 4 )
+	{
+		__m256i order = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(compact_table() + mask * PEL_LANES) );
+		__m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(src) );
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>(dst), _mm256_permutevar8x32_epi32(a, order) );
+		mask = mask - ((mask >> 1) & 0x55);
+		mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+		return (mask + (mask >> 4)) & 0x0F;
+	}
+	#endif
+
+	for( unsigned int l = 0; l < PEL_LANES; ++l ) {
+		if( mask & (1u << l) )
+		{
+			memmove( dst + n * size, src + l * size, size );
+			n++;
+		}
+	}
+	return n;
+}
+
+// Keeps the particles of a program in columns of host memory, one for every
+// persistent field in its declared format, and bound to it. Particles
+// [0, size()) are alive. emit appends new particles and runs a spawn entry
+// point over them, update runs an entry point over all of them. A particle
+// dies when the script sets its kill field to anything but 0.0, afterwards
+// the survivors are moved to the front of every column without changing
+// their order. The program must not be recompiled or rebound while the pool
+// uses it.
+class particle_pool
+{
+	function* program;
+	Local kill;
+	unsigned int alive;
+	unsigned int capacity;
+	std::vector< std::vector<char> > columns;
+	//One bit per particle of the group, set when the particle survives.
+	std::vector<unsigned char> masks;
+
+	// Zeroes field c of particles [first, first + n), the script only writes
+	// the kill field for the particles that die.
+	void clear(unsigned int c, unsigned int first, unsigned int n)
+	{
+		unsigned int size = format_size( program->format( program->localNames[c] ) );
+		memset( &columns[c][first * size], 0, n * size );
+		program->il_touch(c);
+	}
+
+public:
+
+	// Lays out the columns for capacity particles. Returns an empty pool
+	// when the program has no field called kill.
+	particle_pool(function& f, unsigned int capacity, const std::string& killField) : program(&f), kill(0), alive(0), capacity(0)
+	{
+		unsigned int slot = std::find( f.localNames.begin(), f.localNames.end(), killField ) - f.localNames.begin();
+		if( slot == f.localNames.size() )
+		{
+			return;
+		}
+
+		kill = slot;
+		this->capacity = capacity;
+		columns.resize( f.locals.size() );
+		masks.resize( capacity / PEL_LANES + 1 );
+		for( unsigned int i = 0; i < f.locals.size(); ++i ) {
+			const std::string& name = f.localNames[i];
+			if( i == kill || f.usage(name) == usage_persistent )
+			{
+				field_format format = f.format(name);
+				//Compaction stores whole groups, the last one may run past
+				//the end.
+				columns[i].assign( (capacity + PEL_LANES) * format_size(format), 0 );
+				f.bind( name, &columns[i][0], format_size(format), format );
+			}
+		}
+	}
+
+	unsigned int size() const
+	{
+		return alive;
+	}
+
+	// The program the columns are bound to.
+	function& script() const
+	{
+		return *program;
+	}
+
+	// The column of a field, 0 when the field has none. Particle n is at
+	// n * format_size(format(name)).
+	void* column(const std::string& name)
+	{
+		unsigned int slot = std::find( program->localNames.begin(), program->localNames.end(), name ) - program->localNames.begin();
+		return slot < columns.size() && columns[slot].empty() == false ? &columns[slot][0] : 0;
+	}
+
+	// Appends up to count particles with every field 0.0 and runs entry over
+	// them. Returns how many were emitted, the pool never grows past its 
+	// capacity.
+	unsigned int emit(unsigned int count, unsigned int entry)
+	{
+		count = count < capacity - alive ? count : capacity - alive;
+		if( count )
+		{
+			for( unsigned int c = 0; c < columns.size(); ++c ) {
+				if( columns[c].empty() == false )
+				{
+					clear( c, alive, count );
+				}
+			}
+			program->run_batch( count, entry, alive );
+			alive += count;
+			compact();
+		}
+		return count;
+	}
+
+	// Runs entry over every particle and removes those that died.
+	void update(unsigned int entry)
+	{
+		if( alive )
+		{
+			clear( kill, 0, alive );
+			program->run_batch( alive, entry );
+			compact();
+		}
+	}
+
+	// Removes the particles whose kill field is set. The masks of all groups
+	// are computed first, then every column is compacted on its own so it
+	// streams through the cache once. Returns the number of survivors.
+	unsigned int compact()
+	{
+		if( alive == 0 )
+		{
+			return 0;
+		}
+
+		const char* k = &columns[kill][0];
+		field_format format = program->format( program->localNames[kill] );
+		unsigned int size = format_size(format);
+		unsigned int survivors = alive;
+		bool any = false;
+		lanes zero;
+		lanes_splat( zero, 0.0f );
+		for( unsigned int i = 0; i < alive; i += PEL_LANES ) {
+			lanes a;
+			lanes_unpack( a, k + i * size, format );
+			unsigned int mask = lanes_compare( a, zero, 1 );
+			if( alive - i < PEL_LANES )
+			{
+				mask &= (1u << (alive - i)) - 1;
+			}
+			masks[i / PEL_LANES] = (unsigned char)mask;
+			any = any || mask != 0xFF;
+		}
+
+		if( any == false )
+		{
+			return alive;
+		}
+
+		for( unsigned int c = 0; c < columns.size(); ++c ) {
+			if( columns[c].empty() )
+			{
+				continue;
+			}
+
+			char* p = &columns[c][0];
+			unsigned int s = format_size( program->format( program->localNames[c] ) );
+			unsigned int n = 0;
+			for( unsigned int i = 0; i < alive; i += PEL_LANES ) {
+				unsigned int mask = masks[i / PEL_LANES];
+				if( mask == 0xFF && n == i )
+				{
+					n += PEL_LANES;
+					continue;
+				}
+				n += compact_lanes( p + i * s, p + n * s, mask, s );
+			}
+			survivors = n;
+		}
+
+		alive = survivors;
+		return alive;
+	}
+};
+
+#endif //POOL_H
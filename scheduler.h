@@ -0,0 +1,351 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include "compiler.h"
+#include "pool.h"
+
+// Number of level of detail tiers of emitter_scheduler, tier 0 updates on
+// every frame and tier t every 2^t frames unless the host changes it.
+#define PEL_TIERS 4
+
+// An emitter of emitter_scheduler, a pool and the entry point that updates
+// its particles.
+struct emitter
+{
+	particle_pool* pool;
+	unsigned int entry;
+	unsigned int tier;
+	// Frame within the interval of the tier on which the emitter runs.
+	unsigned int phase;
+	// Field of the program that receives the seconds since the emitter last
+	// ran, -1 when it has none.
+	int dt;
+	float elapsed;
+};
+
+// Work shared by the threads of emitter_scheduler::update, every thread
+// takes the next emitter that is due until none are left.
+struct emitter_job
+{
+	std::vector<emitter*>* due;
+	volatile long* next;
+};
+
+inline void emitter_worker(emitter_job* job)
+{
+	for( long i = compile_next(job->next); i < (long)job->due->size(); i = compile_next(job->next) ) {
+		emitter& e = *(*job->due)[i];
+		if( e.dt >= 0 )
+		{
+			e.pool->script().locals[e.dt] = e.elapsed;
+		}
+		e.pool->update( e.entry );
+		e.elapsed = 0.0f;
+	}
+}
+
+// Counting semaphore the workers of emitter_scheduler wait on.
+class emitter_semaphore
+{
+	#if defined(_WIN32)
+	HANDLE handle;
+	#else
+	pthread_mutex_t mutex;
+	pthread_cond_t signal;
+	unsigned int count;
+	#endif
+
+	emitter_semaphore(const emitter_semaphore&);
+	emitter_semaphore& operator=(const emitter_semaphore&);
+
+public:
+	emitter_semaphore()
+	{
+		#if defined(_WIN32)
+		handle = CreateSemaphore(0, 0, 0x7FFFFFFF, 0);
+		#else
+		pthread_mutex_init(&mutex, 0);
+		pthread_cond_init(&signal, 0);
+		count = 0;
+		#endif
+	}
+
+	~emitter_semaphore()
+	{
+		#if defined(_WIN32)
+		CloseHandle(handle);
+		#else
+		pthread_cond_destroy(&signal);
+		pthread_mutex_destroy(&mutex);
+		#endif
+	}
+
+	void post(unsigned int n)
+	{
+		if( n == 0 )
+		{
+			return;
+		}
+
+		#if defined(_WIN32)
+		ReleaseSemaphore(handle, n, 0);
+		#else
+		pthread_mutex_lock(&mutex);
+		count += n;
+		pthread_cond_broadcast(&signal);
+		pthread_mutex_unlock(&mutex);
+		#endif
+	}
+
+	void wait()
+	{
+		#if defined(_WIN32)
+		WaitForSingleObject(handle, INFINITE);
+		#else
+		pthread_mutex_lock(&mutex);
+		while( count == 0 ) {
+			pthread_cond_wait(&signal, &mutex);
+		}
+		count--;
+		pthread_mutex_unlock(&mutex);
+		#endif
+	}
+};
+
+// Threads of emitter_scheduler, they live as long as the scheduler. Every
+// frame wakes as many of them as it needs through go, each one works on
+// the job and reports back through done.
+struct emitter_crew
+{
+	emitter_semaphore go;
+	emitter_semaphore done;
+	emitter_job job;
+	volatile bool stopping;
+};
+
+inline void emitter_serve(emitter_crew* crew)
+{
+	while( true ) {
+		crew->go.wait();
+		if( crew->stopping )
+		{
+			return;
+		}
+		emitter_worker(&crew->job);
+		crew->done.post(1);
+	}
+}
+
+#if defined(_WIN32)
+inline DWORD WINAPI emitter_thread(LPVOID crew)
+{
+	emitter_serve( static_cast<emitter_crew*>(crew) );
+	return 0;
+}
+#else
+inline void* emitter_thread(void* crew)
+{
+	emitter_serve( static_cast<emitter_crew*>(crew) );
+	return 0;
+}
+#endif
+
+// Updates many emitters at the rate of their level of detail. Every emitter
+// belongs to a tier that runs once every so many frames, the emitters of a
+// tier are spread over the frames of its interval so every frame updates
+// about the same number of particles. The emitters that are due run tier by
+// tier, each one as a single batch over all of its particles, on up to as
+// many threads as the host allows. The threads are started by the first
+// update that needs them and wait for the next frame in between. Emitters
+// must not share a program, the pool of every emitter is bound to its own.
+class emitter_scheduler
+{
+	std::vector<emitter> emitters;
+	unsigned int intervals[PEL_TIERS];
+	unsigned int frame;
+	std::string dtField;
+	std::vector<emitter*> due;
+	volatile long next;
+	emitter_crew* crew;
+	#if defined(_WIN32)
+	std::vector<HANDLE> workers;
+	#else
+	std::vector<pthread_t> workers;
+	#endif
+
+	emitter_scheduler(const emitter_scheduler&);
+	emitter_scheduler& operator=(const emitter_scheduler&);
+
+	// Tiers past the last one are the last one.
+	static unsigned int clamp_tier(unsigned int tier)
+	{
+		return tier < PEL_TIERS ? tier : PEL_TIERS - 1;
+	}
+
+	// Phase of tier that updates the fewest particles, ignoring emitter skip.
+	// Empty emitters count as one particle so they are spread as well.
+	unsigned int lightest(unsigned int tier, unsigned int skip)
+	{
+		std::vector<unsigned int> load( intervals[tier], 0 );
+		for( unsigned int i = 0; i < emitters.size(); ++i ) {
+			if( i != skip && emitters[i].tier == tier )
+			{
+				load[emitters[i].phase] += emitters[i].pool->size() + 1;
+			}
+		}
+		return std::min_element( load.begin(), load.end() ) - load.begin();
+	}
+
+public:
+
+	// dtField names the uniform that receives the time since an emitter last
+	// ran, the update of a tier that skips frames has to cover all of them.
+	emitter_scheduler(const std::string& dtField = "dt") : frame(0), dtField(dtField), next(0), crew(new emitter_crew())
+	{
+		for( unsigned int t = 0; t < PEL_TIERS; ++t ) {
+			intervals[t] = 1u << t;
+		}
+		crew->job.due = &due;
+		crew->job.next = &next;
+		crew->stopping = false;
+	}
+
+	~emitter_scheduler()
+	{
+		crew->stopping = true;
+		crew->go.post( workers.size() );
+		for( unsigned int i = 0; i < workers.size(); ++i ) {
+			#if defined(_WIN32)
+			WaitForSingleObject(workers[i], INFINITE);
+			CloseHandle(workers[i]);
+			#else
+			pthread_join(workers[i], 0);
+			#endif
+		}
+		delete crew;
+	}
+
+	// Changes the number of frames between the updates of a tier and spreads
+	// its emitters over the new interval.
+	void interval(unsigned int tier, unsigned int frames)
+	{
+		tier = clamp_tier(tier);
+		intervals[tier] = frames ? frames : 1;
+		rebalance();
+	}
+
+	// Adds an emitter to a tier, returns its index. Tiers past the last one
+	// are the last one.
+	unsigned int add(particle_pool& pool, unsigned int entry, unsigned int tier)
+	{
+		tier = clamp_tier(tier);
+		emitter e;
+		e.pool = &pool;
+		e.entry = entry;
+		e.tier = tier;
+		e.phase = lightest( tier, emitters.size() );
+		e.elapsed = 0.0f;
+
+		Local slot = 0;
+		e.dt = pool.script().il_find_local(dtField, slot) ? (int)slot : -1;
+		emitters.push_back(e);
+		return emitters.size() - 1;
+	}
+
+	unsigned int size() const
+	{
+		return emitters.size();
+	}
+
+	const emitter& operator[](unsigned int i) const
+	{
+		return emitters[i];
+	}
+
+	// Moves an emitter to another tier, for example when the camera moved
+	// away from it. The time it did not run carries over.
+	void assign(unsigned int i, unsigned int tier)
+	{
+		tier = clamp_tier(tier);
+		if( emitters[i].tier != tier )
+		{
+			emitters[i].tier = tier;
+			emitters[i].phase = lightest( tier, i );
+		}
+	}
+
+	// Spreads the emitters of every tier over its frames again, the largest
+	// first. Pools grow and shrink, so the host should call this now and
+	// then.
+	void rebalance()
+	{
+		std::vector< std::pair<unsigned int, unsigned int> > order;
+		for( unsigned int i = 0; i < emitters.size(); ++i ) {
+			order.push_back( std::make_pair(~emitters[i].pool->size(), i) );
+		}
+		std::sort( order.begin(), order.end() );
+
+		std::vector<unsigned int> load[PEL_TIERS];
+		for( unsigned int t = 0; t < PEL_TIERS; ++t ) {
+			load[t].assign( intervals[t], 0 );
+		}
+		for( unsigned int k = 0; k < order.size(); ++k ) {
+			emitter& e = emitters[order[k].second];
+			std::vector<unsigned int>& l = load[e.tier];
+			e.phase = std::min_element( l.begin(), l.end() ) - l.begin();
+			l[e.phase] += e.pool->size() + 1;
+		}
+	}
+
+	// Advances every emitter by dt seconds and updates the ones that are due
+	// this frame on up to threads threads, 0 uses one per core. Threads that
+	// are missing are started and kept for the next frames. Returns the
+	// number of particles that were updated.
+	unsigned int update(float dt, unsigned int threads = 0)
+	{
+		due.clear();
+		unsigned int particles = 0;
+		for( unsigned int t = 0; t < PEL_TIERS; ++t ) {
+			for( unsigned int i = 0; i < emitters.size(); ++i ) {
+				emitter& e = emitters[i];
+				if( e.tier != t )
+				{
+					continue;
+				}
+
+				e.elapsed += dt;
+				if( frame % intervals[t] == e.phase )
+				{
+					due.push_back(&e);
+					particles += e.pool->size();
+				}
+			}
+		}
+		frame++;
+
+		threads = threads == 0 ? core_count() : threads;
+		threads = threads > due.size() ? due.size() : threads;
+		threads = threads == 0 ? 1 : threads;
+
+		//The calling thread updates emitters as well.
+		while( workers.size() < threads - 1 ) {
+			#if defined(_WIN32)
+			workers.push_back( CreateThread(0, 0, emitter_thread, crew, 0, 0) );
+			#else
+			pthread_t handle;
+			pthread_create(&handle, 0, emitter_thread, crew);
+			workers.push_back(handle);
+			#endif
+		}
+
+		next = 0;
+		crew->go.post( threads - 1 );
+		emitter_worker( &crew->job );
+		for( unsigned int i = 1; i < threads; ++i ) {
+			crew->done.wait();
+		}
+
+		return particles;
+	}
+};
+
+#endif //SCHEDULER_H